@@ -0,0 +1,425 @@
+/**
+ *   Copyright (C) 2015 Jeff Trull <edaskel@att.net>
+ *
+ *   Distributed under the Boost Software License, Version 1.0. (See accompanying
+ *   file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+ *
+ *
+ */
+
+// Benchmark for both stages on a synthetic corpus of any size
+// A tree of sources and headers is generated, with a compile_commands.json, in which every
+// function holds expression_capture_N lambdas (for stage 2) and #ifdef TEST_PP_CONDITIONAL
+// hunks nested among other conditionals (for stage 1).  Stage 1 runs in process, through the
+// same library entry point rs2's fused mode uses, one call per source, so per-file latencies
+// can be reported; rs2, if given, runs as a child process over the whole corpus.  Results can
+// be saved as a baseline and later runs compared against it.
+//
+// Each measurement is the best of --repeat runs, and only those stable enough to compare are
+// checked against the baseline: throughput, median latency and peak memory always, the 99th
+// percentile only when there are enough files for it not to be a single slow one.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "stage1.hpp"
+
+extern char ** environ;
+
+// marks a directory as generated by us, and so safe to replace
+char const corpus_marker[] = ".corpus_bench";
+
+// files needed before the 99th percentile latency is compared with a baseline
+std::size_t const p99_min_files = 1000;
+
+// the dimensions of a generated corpus
+struct corpus_shape {
+    std::size_t files;
+    std::size_t functions;      // per file
+    std::size_t lambdas;        // expression_capture_N lambdas per function
+    std::size_t captures;       // variables each lambda captures
+    std::size_t depth;          // conditionals nested inside each hunk
+    std::size_t includes;       // headers included by each source
+    std::size_t headers;        // distinct headers to choose from
+};
+
+std::string source_name(std::size_t k) { return "src/file_" + std::to_string(k) + ".cpp"; }
+std::string header_name(std::size_t h) { return "hdr_" + std::to_string(h) + ".hpp"; }
+
+// the compile command for a source, in compilation database form (compiler first)
+std::vector<std::string> compile_args(boost::filesystem::path const & dir, corpus_shape const & shape,
+                                      std::string const & source) {
+    return {"c++", "-std=c++14", "-I" + (dir / "include").string(),
+            "-DSYNTH_LEVEL=" + std::to_string(shape.depth), "-c", source};
+}
+
+// One function: its lambdas use the captures in each of the ways stage 2 distinguishes,
+// then a hunk (in a block of its own, so stage 1's lambdas don't collide with ours)
+void write_function(std::ostream & os, corpus_shape const & shape, std::size_t file, std::size_t fn,
+                    std::size_t & lambda_number) {
+    os << "int work_" << file << "_" << fn << "(int a) {\n";
+    for (std::size_t c = 0; c < shape.captures; ++c) {
+        os << "    int c" << c << " = a + " << c << ";\n";
+    }
+    for (std::size_t l = 0; l < shape.lambdas; ++l) {
+        std::size_t n = lambda_number++;
+        os << "    auto expression_capture_" << n << " = [&]() -> void {\n";
+        for (std::size_t c = 0; c < shape.captures; ++c) {
+            switch ((c + l) % 4) {
+            case 0:  os << "        c" << c << " = c" << c << " + 1;\n"; break;
+            case 1:  os << "        bump(c" << c << ");\n";            break;
+            case 2:  os << "        ++c" << c << ";\n";                break;
+            default: os << "        (void)(c" << c << " * 2);\n";      break;
+            }
+        }
+        os << "    };\n";
+        os << "    expression_capture_" << n << "();\n";
+    }
+    os << "    {\n";
+    os << "#ifdef TEST_PP_CONDITIONAL\n";
+    os << "        a += 1;\n";
+    os << "#else\n";
+    for (std::size_t d = 1; d <= shape.depth; ++d) {
+        os << "#if SYNTH_LEVEL >= " << d << "\n";
+        os << "        a += " << d << ";\n";
+    }
+    for (std::size_t d = 0; d < shape.depth; ++d) {
+        os << "#endif\n";
+    }
+    os << "        a -= 1;\n";
+    os << "#endif\n";
+    os << "    }\n";
+    os << "    return a";
+    for (std::size_t c = 0; c < shape.captures; ++c) {
+        os << " + c" << c;
+    }
+    os << ";\n}\n\n";
+}
+
+// Make dir ready for a new corpus: only a directory that is empty, or that holds an earlier
+// corpus (and our marker), is used
+bool prepare_corpus_dir(boost::filesystem::path const & dir) {
+    namespace fs = boost::filesystem;
+    boost::system::error_code ec;
+    if (fs::exists(dir / corpus_marker, ec)) {
+        fs::remove_all(dir, ec);
+    } else if (fs::exists(dir, ec) && !(fs::is_directory(dir, ec) && fs::is_empty(dir, ec))) {
+        std::cerr << dir.string() << " exists and does not hold a corpus from an earlier run; "
+                  << "not replacing it\n";
+        return false;
+    }
+    fs::create_directories(dir / "include", ec);
+    fs::create_directories(dir / "src", ec);
+    std::ofstream((dir / corpus_marker).string()) << "generated by corpus_bench; replaced by its next run\n";
+    if (ec || !fs::exists(dir / corpus_marker)) {
+        std::cerr << "cannot create the corpus in " << dir.string() << "\n";
+        return false;
+    }
+    return true;
+}
+
+// generate the corpus under dir (prepared as above), returning the total size of its sources
+std::uintmax_t write_corpus(boost::filesystem::path const & dir, corpus_shape const & shape) {
+    {
+        std::ofstream common((dir / "include" / "common.hpp").string());
+        common << "#ifndef SYNTH_COMMON_HPP\n#define SYNTH_COMMON_HPP\n"
+               << "inline void bump(int & x) { ++x; }\n"
+               << "#endif\n";
+    }
+    for (std::size_t h = 0; h < shape.headers; ++h) {
+        std::ofstream header((dir / "include" / header_name(h)).string());
+        header << "#ifndef SYNTH_HDR_" << h << "\n#define SYNTH_HDR_" << h << "\n"
+               << "#include \"common.hpp\"\n"
+               << "inline int helper_" << h << "(int x) {\n"
+               << "#if SYNTH_LEVEL > 0\n    return x + " << h << ";\n#else\n    return x;\n#endif\n"
+               << "}\n#endif\n";
+    }
+
+    std::uintmax_t bytes = 0;
+    std::ofstream db((dir / "compile_commands.json").string());
+    db << "[\n";
+    for (std::size_t k = 0; k < shape.files; ++k) {
+        std::ostringstream os;
+        os << "// generated by corpus_bench\n";
+        os << "#include \"common.hpp\"\n";
+        for (std::size_t i = 0; i < shape.includes; ++i) {
+            // spread the includes so sources share some headers but not all
+            os << "#include \"" << header_name((k * 7 + i) % std::max<std::size_t>(1, shape.headers)) << "\"\n";
+        }
+        os << "\n";
+        std::size_t lambda_number = 0;
+        for (std::size_t fn = 0; fn < shape.functions; ++fn) {
+            write_function(os, shape, k, fn, lambda_number);
+        }
+        std::string text = os.str();
+        bytes += text.size();
+        std::ofstream((dir / source_name(k)).string(), std::ios::binary) << text;
+
+        db << "  {\"directory\": \"" << dir.string() << "\", \"arguments\": [";
+        std::vector<std::string> args = compile_args(dir, shape, source_name(k));
+        for (std::size_t a = 0; a < args.size(); ++a) {
+            db << (a ? ", " : "") << "\"" << args[a] << "\"";
+        }
+        db << "], \"file\": \"" << source_name(k) << "\"}" << ((k + 1 < shape.files) ? ",\n" : "\n");
+    }
+    db << "]\n";
+    return bytes;
+}
+
+// the q-th quantile of sorted values
+double quantile(std::vector<double> const & sorted, double q) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[std::min(sorted.size() - 1, static_cast<std::size_t>(q * sorted.size()))];
+}
+
+long peak_rss_kib(int who) {
+    rusage usage;
+    getrusage(who, &usage);
+    return usage.ru_maxrss;      // kilobytes, on Linux
+}
+
+// Run a program, with its output discarded, returning its wait status (or -1)
+// Spawned directly, so the arguments may be as many and as long as the system allows.
+int run_quietly(std::vector<std::string> const & args) {
+    std::vector<char *> argv;
+    for (std::string const & arg : args) {
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    pid_t pid;
+    int err = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err) {
+        return -1;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return status;
+}
+
+// One measurement, with the direction in which it gets better
+struct metric {
+    std::string name;
+    double      value;
+    bool        higher_is_better;
+    bool        gated;              // compared with the baseline (others are only reported)
+};
+
+// the better of two values of a metric
+double best(double a, double b, bool higher_is_better) {
+    return higher_is_better ? std::max(a, b) : std::min(a, b);
+}
+
+// "name value" lines
+std::map<std::string, double> read_baseline(std::string const & path) {
+    std::map<std::string, double> values;
+    std::ifstream in(path);
+    std::string name;
+    double value;
+    while (in >> name >> value) {
+        values[name] = value;
+    }
+    return values;
+}
+
+int main(int argc, char const ** argv) {
+    namespace po = boost::program_options;
+    namespace fs = boost::filesystem;
+
+    po::options_description desc("Options");
+    desc.add_options()
+        ("help,h", "produce this message")
+        ("corpus", po::value<std::string>()->default_value("synth_corpus"),
+         "generate the corpus in this directory, which must be empty or hold an earlier corpus")
+        ("files", po::value<std::size_t>()->default_value(100), "source files")
+        ("functions", po::value<std::size_t>()->default_value(10), "functions per file")
+        ("lambdas", po::value<std::size_t>()->default_value(3), "expression_capture_N lambdas per function")
+        ("captures", po::value<std::size_t>()->default_value(4), "variables captured by each lambda")
+        ("depth", po::value<std::size_t>()->default_value(2), "conditionals nested within each hunk")
+        ("includes", po::value<std::size_t>()->default_value(4), "headers included by each source")
+        ("headers", po::value<std::size_t>()->default_value(16), "distinct headers")
+        ("jobs,j", po::value<unsigned>()->default_value(1), "threads running stage 1")
+        ("repeat", po::value<unsigned>()->default_value(3), "runs of each stage, keeping the best results")
+        ("rs2", po::value<std::string>(), "also time this rs2 executable over the corpus")
+        ("rs2-args", po::value<std::string>()->default_value(""),
+         "extra options for rs2, separated by spaces, e.g. \"-j 8\"")
+        ("save-baseline", po::value<std::string>(), "write the results to this file")
+        ("baseline", po::value<std::string>(), "compare the results with this file, failing on a regression")
+        ("tolerance", po::value<double>()->default_value(0.15),
+         "how much worse than the baseline a result may be, as a fraction");
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+    } catch (po::error const& e) {
+        std::cerr << e.what() << "\n" << desc << "\n";
+        return 1;
+    }
+    if (vm.count("help")) {
+        std::cout << "usage: " << argv[0] << " [options]\n" << desc << "\n";
+        return 0;
+    }
+
+    corpus_shape shape{vm["files"].as<std::size_t>(), vm["functions"].as<std::size_t>(),
+                       vm["lambdas"].as<std::size_t>(), vm["captures"].as<std::size_t>(),
+                       vm["depth"].as<std::size_t>(), vm["includes"].as<std::size_t>(),
+                       vm["headers"].as<std::size_t>()};
+    fs::path dir = fs::absolute(vm["corpus"].as<std::string>());
+    if (!prepare_corpus_dir(dir)) {
+        return 1;
+    }
+    std::uintmax_t bytes = write_corpus(dir, shape);
+    std::cout << "corpus: " << shape.files << " files of " << shape.functions << " functions, "
+              << shape.lambdas << " lambdas with " << shape.captures << " captures each, hunk depth "
+              << shape.depth << ", " << shape.includes << " includes (" << bytes / 1024 << " KiB)\n";
+
+    using clock = std::chrono::steady_clock;
+    unsigned const repeat = std::max(1u, vm["repeat"].as<unsigned>());
+    std::vector<metric> metrics;
+    // record a metric, keeping the best value over the runs
+    auto measure = [&](std::string const & name, double value, bool higher_is_better, bool gated) {
+        for (metric & m : metrics) {
+            if (m.name == name) {
+                m.value = best(m.value, value, higher_is_better);
+                return;
+            }
+        }
+        metrics.push_back(metric{name, value, higher_is_better, gated});
+    };
+
+    // stage 1, one call per source so each can be timed
+    for (unsigned run = 0; run < repeat; ++run) {
+        std::vector<double> latency_ms(shape.files);
+        std::atomic<std::size_t> next(0), failures(0);
+        std::vector<std::string> const macros{"TEST_PP_CONDITIONAL"};
+        auto worker = [&]() {
+            for (std::size_t k = next++; k < shape.files; k = next++) {
+                std::string text, errors;
+                auto start = clock::now();
+                stage1_result r = stage1_preprocess(source_name(k), dir.string(),
+                                                    compile_args(dir, shape, source_name(k)),
+                                                    macros, text, errors);
+                latency_ms[k] = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+                if (r != stage1_result::rewritten) {
+                    std::cerr << source_name(k) << ": not rewritten\n" << errors;
+                    failures++;
+                }
+            }
+        };
+        auto start = clock::now();
+        std::vector<std::thread> pool;
+        for (unsigned t = 0; t < std::max(1u, vm["jobs"].as<unsigned>()); ++t) {
+            pool.emplace_back(worker);
+        }
+        for (std::thread & t : pool) {
+            t.join();
+        }
+        double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+        std::sort(latency_ms.begin(), latency_ms.end());
+        long rss = peak_rss_kib(RUSAGE_SELF);
+        std::cout << "stage 1: " << elapsed << "s, " << shape.files / elapsed << " files/s, "
+                  << bytes / elapsed / 1e6 << " MB/s; latency p50 " << quantile(latency_ms, 0.5)
+                  << "ms, p90 " << quantile(latency_ms, 0.9) << "ms, p99 " << quantile(latency_ms, 0.99)
+                  << "ms, max " << quantile(latency_ms, 1.0) << "ms; peak RSS " << rss << " KiB\n";
+        if (failures) {
+            std::cerr << failures << " files failed in stage 1\n";
+            return 1;
+        }
+        measure("stage1_files_per_s", shape.files / elapsed, true, true);
+        measure("stage1_p50_ms", quantile(latency_ms, 0.5), false, true);
+        measure("stage1_p99_ms", quantile(latency_ms, 0.99), false, shape.files >= p99_min_files);
+        measure("stage1_peak_rss_kib", static_cast<double>(rss), false, true);
+    }
+
+    // rs2 over the whole corpus, as a child process reading the sources from a file
+    if (vm.count("rs2")) {
+        std::string const list = (dir / "sources.txt").string();
+        {
+            std::ofstream out(list);
+            for (std::size_t k = 0; k < shape.files; ++k) {
+                out << (dir / source_name(k)).string() << "\n";
+            }
+        }
+        std::vector<std::string> args{vm["rs2"].as<std::string>(), "-p", dir.string(), "--sources-from", list};
+        std::istringstream extra(vm["rs2-args"].as<std::string>());
+        for (std::string arg; extra >> arg;) {
+            args.push_back(arg);
+        }
+        for (unsigned run = 0; run < repeat; ++run) {
+            auto start = clock::now();
+            int status = run_quietly(args);
+            double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+            long rss = peak_rss_kib(RUSAGE_CHILDREN);
+            if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+                std::cerr << "rs2 failed (wait status " << status << ")\n";
+                return 1;
+            }
+            std::cout << "rs2: " << elapsed << "s, " << shape.files / elapsed << " files/s, "
+                      << shape.files * shape.functions * shape.lambdas / elapsed << " lambdas/s; peak RSS "
+                      << rss << " KiB\n";
+            measure("rs2_files_per_s", shape.files / elapsed, true, true);
+            measure("rs2_peak_rss_kib", static_cast<double>(rss), false, true);
+        }
+    }
+
+    if (vm.count("save-baseline")) {
+        std::ofstream out(vm["save-baseline"].as<std::string>());
+        for (metric const & m : metrics) {
+            out << m.name << " " << m.value << "\n";
+        }
+    }
+
+    int result = 0;
+    if (vm.count("baseline")) {
+        std::map<std::string, double> baseline = read_baseline(vm["baseline"].as<std::string>());
+        if (baseline.empty()) {
+            std::cerr << "could not read baseline " << vm["baseline"].as<std::string>() << "\n";
+            return 1;
+        }
+        double const tolerance = vm["tolerance"].as<double>();
+        for (metric const & m : metrics) {
+            auto it = baseline.find(m.name);
+            if ((it == baseline.end()) || (it->second <= 0)) {
+                continue;
+            }
+            double ratio = m.value / it->second;
+            bool regressed = m.gated &&
+                (m.higher_is_better ? (ratio < 1 - tolerance) : (ratio > 1 + tolerance));
+            std::cout << m.name << ": " << m.value << " vs. " << it->second << " (x" << ratio << ")"
+                      << (regressed ? "  REGRESSION" : "") << (m.gated ? "" : "  (not checked)") << "\n";
+            if (regressed) {
+                result = 1;
+            }
+        }
+    }
+    return result;
+}
@@ -0,0 +1,287 @@
+/**
+ *   Copyright (C) 2015 Jeff Trull <edaskel@att.net>
+ *
+ *   Distributed under the Boost Software License, Version 1.0. (See accompanying
+ *   file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+ *
+ *
+ */
+
+// Finds the preprocessor directives in a source file without tokenizing the rest of it.
+// Ordinary lines are only examined closely enough to know where comments and string
+// literals (which may hide a "#" at the start of a line) begin and end.
+
+#ifndef DIRECTIVE_SCANNER_HPP
+#define DIRECTIVE_SCANNER_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+#include <boost/utility/string_ref.hpp>
+
+enum class directive_kind { if_, ifdef, ifndef, elif, else_, endif, define, undef, include, line, error, other };
+
+inline char const * directive_name(directive_kind kind) {
+    switch (kind) {
+    case directive_kind::if_:     return "if";
+    case directive_kind::ifdef:   return "ifdef";
+    case directive_kind::ifndef:  return "ifndef";
+    case directive_kind::elif:    return "elif";
+    case directive_kind::else_:   return "else";
+    case directive_kind::endif:   return "endif";
+    case directive_kind::define:  return "define";
+    case directive_kind::undef:   return "undef";
+    case directive_kind::include: return "include";
+    case directive_kind::line:    return "line";
+    case directive_kind::error:   return "error";
+    default:                      return "other";
+    }
+}
+
+struct directive {
+    directive_kind    kind;
+    boost::string_ref args;      // the text following the directive name, with comments and
+                                 // line splices removed and surrounding whitespace trimmed
+    std::size_t       line;      // where its "#" appears
+    char const *      begin;     // start of that line
+    char const *      end;       // just past its last line (including the newline)
+};
+
+// Calls f(directive) for each directive, in order.  f returns false to stop the scan early.
+// Returns false if stopped, true if the whole text was scanned.
+template <typename F>
+bool for_each_directive(char const * first, char const * last, F f) {
+    auto is_ident_start = [](char c) {
+        return ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) || (c == '_');
+    };
+    auto is_ident_char = [&](char c) { return is_ident_start(c) || ((c >= '0') && (c <= '9')); };
+    auto is_space = [](char c) { return (c == ' ') || (c == '\t') || (c == '\f') || (c == '\v') || (c == '\r'); };
+
+    char const * p = first;
+    std::size_t line = 1;
+    std::string text;      // the current directive, reused to avoid allocation
+
+    // consume a backslash-newline, if there is one at p
+    auto splice = [&]() {
+        if ((p != last) && (*p == '\\')) {
+            char const * q = p + 1;
+            if ((q != last) && (*q == '\r')) {
+                ++q;
+            }
+            if ((q != last) && (*q == '\n')) {
+                p = q + 1;
+                ++line;
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // skip a block comment starting at p (just after the opening "/*")
+    auto block_comment = [&]() {
+        while (p != last) {
+            if ((*p == '*') && (p + 1 != last) && (p[1] == '/')) {
+                p += 2;
+                return;
+            }
+            if (*p == '\n') {
+                ++line;
+            }
+            ++p;
+        }
+    };
+
+    // skip a quoted literal starting at p (just after the opening quote); literals end at
+    // the closing quote or, if unterminated, the end of the line
+    auto quoted = [&](char quote, std::string * copy) {
+        while (p != last) {
+            if (splice()) {
+                continue;
+            }
+            char c = *p;
+            if (c == '\n') {
+                return;
+            }
+            ++p;
+            if (copy) {
+                *copy += c;
+            }
+            if (c == quote) {
+                return;
+            }
+            if ((c == '\\') && (p != last) && (*p != '\n')) {
+                if (copy) {
+                    *copy += *p;
+                }
+                ++p;
+            }
+        }
+    };
+
+    // skip a raw string literal starting at p (just after R")
+    auto raw_string = [&]() {
+        char const * delim = p;
+        while ((p != last) && (*p != '(') && (*p != '\n')) {
+            ++p;
+        }
+        if ((p == last) || (*p == '\n')) {
+            return;        // malformed; resume scanning at the line end
+        }
+        std::string close = ")" + std::string(delim, p) + "\"";
+        char const * end = std::search(p + 1, last, close.begin(), close.end());
+        for (char const * q = p; q != end; ++q) {
+            if (*q == '\n') {
+                ++line;
+            }
+        }
+        p = (end == last) ? last : end + close.size();
+    };
+
+    while (p != last) {
+        // at the start of a line: is this a directive?
+        char const * const line_start = p;
+        for (;;) {
+            if ((p != last) && is_space(*p)) {
+                ++p;
+            } else if (!splice()) {
+                break;
+            }
+        }
+        if ((p != last) && (*p == '#')) {
+            std::size_t const directive_line = line;
+            ++p;
+            text.clear();
+            // gather the logical line, replacing comments with a space
+            while (p != last) {
+                if (splice()) {
+                    continue;
+                }
+                char c = *p;
+                if (c == '\n') {
+                    break;
+                }
+                if ((c == '/') && (p + 1 != last) && (p[1] == '*')) {
+                    p += 2;
+                    block_comment();
+                    text += ' ';
+                } else if ((c == '/') && (p + 1 != last) && (p[1] == '/')) {
+                    while ((p != last) && (*p != '\n')) {
+                        if (!splice()) {
+                            ++p;
+                        }
+                    }
+                } else if ((c == '"') || (c == '\'')) {
+                    ++p;
+                    text += c;
+                    quoted(c, &text);
+                } else {
+                    text += is_space(c) ? ' ' : c;
+                    ++p;
+                }
+            }
+
+            // split into name and arguments
+            std::size_t start = text.find_first_not_of(' ');
+            if (start == std::string::npos) {
+                start = text.size();
+            }
+            std::size_t name_end = start;
+            while ((name_end != text.size()) && is_ident_char(text[name_end])) {
+                ++name_end;
+            }
+            boost::string_ref name(text.data() + start, name_end - start);
+            std::size_t args_begin = text.find_first_not_of(' ', name_end);
+            std::size_t args_end = text.find_last_not_of(' ');
+            boost::string_ref args;
+            if ((args_begin != std::string::npos) && (args_end >= args_begin)) {
+                args = boost::string_ref(text.data() + args_begin, args_end + 1 - args_begin);
+            }
+
+            directive_kind kind = directive_kind::other;
+            if (name == "if") {
+                kind = directive_kind::if_;
+            } else if (name == "ifdef") {
+                kind = directive_kind::ifdef;
+            } else if (name == "ifndef") {
+                kind = directive_kind::ifndef;
+            } else if (name == "elif") {
+                kind = directive_kind::elif;
+            } else if (name == "else") {
+                kind = directive_kind::else_;
+            } else if (name == "endif") {
+                kind = directive_kind::endif;
+            } else if (name == "define") {
+                kind = directive_kind::define;
+            } else if (name == "undef") {
+                kind = directive_kind::undef;
+            } else if ((name == "include") || (name == "include_next")) {
+                kind = directive_kind::include;
+            } else if (name == "line") {
+                kind = directive_kind::line;
+            } else if ((name == "error") || (name == "warning")) {
+                kind = directive_kind::error;
+            }
+            char const * const line_end = (p == last) ? last : p + 1;
+            if (!f(directive{kind, args, directive_line, line_start, line_end})) {
+                return false;
+            }
+        } else {
+            // an ordinary line: find its end, stepping over anything that might contain one
+            while (p != last) {
+                if (splice()) {
+                    continue;
+                }
+                char c = *p;
+                if (c == '\n') {
+                    break;
+                }
+                if (is_ident_start(c)) {
+                    char const * ident = p;
+                    while ((p != last) && is_ident_char(*p)) {
+                        ++p;
+                    }
+                    // raw string prefixes
+                    std::size_t len = p - ident;
+                    if ((p != last) && (*p == '"') && (ident[len - 1] == 'R') &&
+                        ((len == 1) || ((len == 2) && std::strchr("uUL", ident[0])) ||
+                         ((len == 3) && (ident[0] == 'u') && (ident[1] == '8')))) {
+                        ++p;
+                        raw_string();
+                    }
+                } else if ((c >= '0') && (c <= '9')) {
+                    // numbers, which may contain digit separators
+                    while ((p != last) && (is_ident_char(*p) || (*p == '.') || (*p == '\''))) {
+                        char prev = *p++;
+                        if ((p != last) && ((*p == '+') || (*p == '-')) &&
+                            std::strchr("eEpP", prev)) {
+                            ++p;
+                        }
+                    }
+                } else if ((c == '"') || (c == '\'')) {
+                    ++p;
+                    quoted(c, nullptr);
+                } else if ((c == '/') && (p + 1 != last) && (p[1] == '*')) {
+                    p += 2;
+                    block_comment();
+                } else if ((c == '/') && (p + 1 != last) && (p[1] == '/')) {
+                    while ((p != last) && (*p != '\n')) {
+                        if (!splice()) {
+                            ++p;
+                        }
+                    }
+                } else {
+                    ++p;
+                }
+            }
+        }
+        if (p != last) {
+            ++p;      // the newline
+            ++line;
+        }
+    }
+    return true;
+}
+
+#endif // DIRECTIVE_SCANNER_HPP
@@ -0,0 +1,267 @@
+/**
+ *   Copyright (C) 2015 Jeff Trull <edaskel@att.net>
+ *
+ *   Distributed under the Boost Software License, Version 1.0. (See accompanying
+ *   file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+ *
+ *
+ */
+
+// Micro-benchmark: event dispatch in the table-driven pp_fsm versus the Boost.MSM machine
+// it replaced.  Both are driven with the same synthetic stream of directive events, the
+// kind a large translation unit produces, and must agree on the hunks they find.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Boost Meta State Machine library (for the original version)
+// Its transition table, with the #elif rows, is longer than MPL's default limit of 20
+#define BOOST_MPL_CFG_NO_PREPROCESSED_HEADERS
+#define BOOST_MPL_LIMIT_VECTOR_SIZE 30
+#include <boost/msm/front/state_machine_def.hpp>
+#include <boost/msm/back/state_machine.hpp>
+// for the Not_ operator
+#include <boost/msm/front/euml/operator.hpp>
+// for the ActionSequence_ operator
+#include <boost/msm/front/functor_row.hpp>
+
+#include "pp_fsm.hpp"
+
+namespace msm_version {
+
+using namespace boost;
+using boost::msm::front::euml::Not_;
+using boost::msm::front::ActionSequence_;
+using boost::msm::front::Row;
+
+// the machine as it was in refactor_stage1.cpp, with the #elif rows of the table version
+// added so the two can be compared on the same events
+// events - currently expecting these to be external (Wave tokens?)
+struct condtrue  {};    // if or ifdef applying to our condition==true, OR "else" of opposite
+struct condfalse {};    // if or ifdef applying to our condition==false or "else" of opposite
+struct tok_if    {};    // if or ifdef unrelated to our condition
+struct tok_elif  {};    // encountered elif
+struct tok_else  {};    // encountered else
+struct tok_endif {};    // encountered endif
+
+struct pp_state : msm::front::state_machine_def<pp_state> {
+
+    pp_state() : m_stack_depth(0), m_sink(nullptr), m_macro(0) {}
+
+    // states
+    struct inactive : msm::front::state<> {};
+    typedef inactive initial_state;
+
+    struct condtrue_code : msm::front::state<> {};
+
+    // inside the body of a target hunk whose condition was false
+    struct condfalse_code : msm::front::state<> {};
+
+    // inside the ELSE clause of a target hunk whose condition was true
+    struct condtrue_else : msm::front::state<> {};
+
+    // inside an #elif (and any later branches) after a false condition
+    struct condfalse_elif : msm::front::state<> {};
+
+    // actions
+    // can make the incr/decr a simple lambda?
+    struct push_stack {
+        template<class Event, class Source, class Target>
+        void operator()(Event const&, pp_state& fsm, Source const&, Target const&) {
+            fsm.m_stack_depth++;
+        }
+    };
+
+    struct pop_stack {
+        template<class Source, class Target>
+        void operator()(tok_endif const&, pp_state& fsm, Source const&, Target const&) {
+            fsm.m_stack_depth--;
+        }
+    };
+
+    struct begin_lambda {
+        template<class Source, class Target, class Event>
+        void operator()(Event const&, pp_state const& fsm, Source const&, Target const&) {
+            // output start of lambda
+            // coming from a false condition means the lambda is the body of its #else
+            if (fsm.m_sink) {
+                fsm.m_sink->begin_lambda(fsm.m_macro,
+                                         std::is_same<Source, condfalse_code>::value);
+            }
+        }
+    };
+
+    struct end_lambda {
+        template<class Source, class Target, class Event>
+        void operator()(Event const&, pp_state const& fsm, Source const&, Target const&) {
+            // output end of lambda
+            if (fsm.m_sink) {
+                fsm.m_sink->end_lambda(fsm.m_macro);
+            }
+        }
+    };
+
+    // define composite actions
+    typedef ActionSequence_<mpl::vector<push_stack, begin_lambda> > enter_target;
+    typedef ActionSequence_<mpl::vector<pop_stack,  end_lambda> >   leave_target;
+    typedef ActionSequence_<mpl::vector<pop_stack, begin_lambda, end_lambda> > empty_target;
+
+    // guards
+    struct first_level {
+        template<class Event, class Source, class Target>
+        bool operator()(Event const&, pp_state const& fsm, Source const&, Target const&) {
+            return fsm.m_stack_depth == 1;
+        }
+    };
+
+    size_t m_stack_depth;   // counter to remember where we are in the nested PP directives
+    output_sink * m_sink;   // destination for lambda delimiters (same as for the tokens), if any
+    std::size_t m_macro;    // which of the sink's macros this FSM tracks
+
+    // transition table
+    // We need to include internal transitions with counter increment/decrement actions
+    // This table assumes we transition into "inactive" on tok_endif from stack depth 1
+    typedef boost::msm::front::none none;
+    struct transition_table : mpl::vector<
+        //    State           Event      Next            Action        Guard
+        Row < inactive,       condtrue,  condtrue_code,  enter_target, none              >,
+        Row < condtrue_code,  tok_if,    condtrue_code,  push_stack,   none              >,
+        Row < condtrue_code,  tok_endif, condtrue_code,  pop_stack,    Not_<first_level> >,
+        Row < condtrue_code,  tok_endif, inactive,       leave_target, first_level       >,
+        Row < condtrue_code,  tok_else,  condtrue_else,  end_lambda,   first_level       >,
+        Row < condtrue_code,  tok_elif,  condtrue_else,  end_lambda,   first_level       >,
+
+        // transitions for if/ifdef/ifndef of target hunk with false condition
+        Row < inactive,       condfalse, condfalse_code, push_stack,   none              >,
+        Row < condfalse_code, tok_if,    condfalse_code, push_stack,   none              >,
+        Row < condfalse_code, tok_endif, inactive,       empty_target, first_level       >,
+        Row < condfalse_code, tok_endif, condfalse_code, pop_stack,    Not_<first_level> >,
+        Row < condfalse_code, tok_else,  condtrue_code,  begin_lambda, first_level       >,
+        Row < condfalse_code, tok_elif,  condfalse_elif, begin_lambda, first_level       >,
+
+        Row < condfalse_elif, tok_if,    condfalse_elif, push_stack,   none              >,
+        Row < condfalse_elif, tok_endif, inactive,       leave_target, first_level       >,
+        Row < condfalse_elif, tok_endif, condfalse_elif, pop_stack,    Not_<first_level> >,
+        Row < condfalse_elif, tok_else,  condfalse_elif, none,         none              >,
+        Row < condfalse_elif, tok_elif,  condfalse_elif, none,         none              >,
+
+        // transitions for ELSE clause of target hunk with true condition
+        Row < condtrue_else,  tok_if,    condtrue_else,  push_stack,   none              >,
+        Row < condtrue_else,  tok_endif, inactive,       pop_stack,    first_level       >,
+        Row < condtrue_else,  tok_endif, condtrue_else,  pop_stack,    Not_<first_level> >,
+        Row < condtrue_else,  tok_else,  condtrue_else,  none,         none              >,
+        Row < condtrue_else,  tok_elif,  condtrue_else,  none,         none              >,
+
+        // transitions for inactive state (discard everything except our target)
+        Row < inactive,       tok_if,    inactive,       none,         none              >,
+        Row < inactive,       tok_endif, inactive,       none,         none              >,
+        Row < inactive,       tok_else,  inactive,       none,         none              >,
+        Row < inactive,       tok_elif,  inactive,       none,         none              >
+
+        > {};
+        
+};
+
+typedef msm::back::state_machine<pp_state> msm_fsm;
+
+}
+
+// A plausible event stream: unrelated conditionals everywhere, and now and then one of ours,
+// with further conditionals nested inside.  Events are sent only to FSMs inside a hunk, so
+// condtrue/condfalse arrive only in the inactive state, as they do from hunk_tracker.
+std::vector<pp_event> make_events(std::size_t count, unsigned seed) {
+    std::mt19937 gen(seed);
+    std::vector<pp_event> events;
+    events.reserve(count + 64);
+    while (events.size() < count) {
+        events.push_back((gen() % 2) ? pp_event::condtrue : pp_event::condfalse);
+        // the body of the hunk: a random nest of other conditionals
+        std::size_t depth = 1;
+        bool else_seen = false;
+        while (depth) {
+            switch (gen() % 5) {
+            case 0:
+                if (depth < 8) {
+                    events.push_back(pp_event::tok_if);
+                    depth++;
+                }
+                break;
+            case 1:
+                if ((depth > 1) || !else_seen) {
+                    events.push_back(pp_event::tok_else);
+                    else_seen = else_seen || (depth == 1);
+                }
+                break;
+            case 2:
+                if ((depth > 1) || !else_seen) {
+                    events.push_back(pp_event::tok_elif);
+                }
+                break;
+            default:
+                events.push_back(pp_event::tok_endif);
+                depth--;
+                break;
+            }
+        }
+    }
+    return events;
+}
+
+int main(int argc, char ** argv) {
+    std::size_t const count = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 50000000;
+    std::vector<pp_event> const events = make_events(count, 1);
+
+    auto macros = std::make_shared<macro_set const>(std::vector<std::string>{"TEST_PP_CONDITIONAL"});
+    using clock = std::chrono::steady_clock;
+
+    // the hunks each machine found, as delimiters in the output
+    std::ostringstream table_text, msm_text;
+
+    double table_s, msm_s;
+    {
+        buffered_writer text(table_text);
+        output_sink sink(text, macros);
+        pp_fsm fsm;
+        fsm.m_sink = &sink;
+        auto start = clock::now();
+        for (pp_event e : events) {
+            fsm.process_event(e);
+        }
+        table_s = std::chrono::duration<double>(clock::now() - start).count();
+    }
+    {
+        buffered_writer text(msm_text);
+        output_sink sink(text, macros);
+        msm_version::msm_fsm fsm;
+        fsm.m_sink = &sink;
+        fsm.start();
+        auto start = clock::now();
+        for (pp_event e : events) {
+            switch (e) {
+            case pp_event::condtrue:  fsm.process_event(msm_version::condtrue());  break;
+            case pp_event::condfalse: fsm.process_event(msm_version::condfalse()); break;
+            case pp_event::tok_if:    fsm.process_event(msm_version::tok_if());    break;
+            case pp_event::tok_elif:  fsm.process_event(msm_version::tok_elif());  break;
+            case pp_event::tok_else:  fsm.process_event(msm_version::tok_else());  break;
+            case pp_event::tok_endif: fsm.process_event(msm_version::tok_endif()); break;
+            }
+        }
+        msm_s = std::chrono::duration<double>(clock::now() - start).count();
+    }
+
+    std::cout << events.size() << " events\n";
+    std::cout << "table-driven: " << table_s << "s, " << events.size() / table_s / 1e6 << "M events/s\n";
+    std::cout << "Boost.MSM:    " << msm_s << "s, " << events.size() / msm_s / 1e6 << "M events/s\n";
+    if (table_text.str() != msm_text.str()) {
+        std::cout << "MISMATCH: the machines found different hunks\n";
+        return 1;
+    }
+    return 0;
+}
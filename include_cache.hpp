@@ -0,0 +1,291 @@
+/**
+ *   Copyright (C) 2015 Jeff Trull <edaskel@att.net>
+ *
+ *   Distributed under the Boost Software License, Version 1.0. (See accompanying
+ *   file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+ *
+ *
+ */
+
+// A process-wide cache of lexed include files, and a Wave iteration context policy using it
+//
+// Every Wave context lexes each header it includes from scratch, so a batch of translation
+// units that all include <iostream> lexes it once per TU.  Here we lex each header once,
+// store its token stream, and replay it for every later #include of the same file.
+//
+// Sharing between worker threads: Wave tokens hold copy-on-write strings with unsynchronized
+// reference counts, so they must never be shared between threads.  The cache instead stores
+// an immutable, plain representation (token ids, positions, and all token text in one
+// std::string).  Each thread's replay lexer builds fresh Wave tokens from it on demand.
+// Entries are handed out as shared_ptr<cached_file const>, so a header being replayed stays
+// alive even if another thread replaces its entry after the file changed on disk.
+
+#ifndef INCLUDE_CACHE_HPP
+#define INCLUDE_CACHE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <boost/wave/cpp_exceptions.hpp>
+#include <boost/wave/language_support.hpp>
+#include <boost/wave/token_ids.hpp>
+#include <boost/wave/cpplexer/cpp_lex_interface_generator.hpp>
+
+#include "mmap_iteration_policy.hpp"
+
+// one token of a cached file; its text is stored in cached_file::text
+struct cached_token {
+    boost::wave::token_id id;
+    std::uint32_t         offset;
+    std::uint32_t         length;
+    std::uint32_t         line;
+    std::uint32_t         column;
+};
+
+// the lexed contents of one file, never modified after construction
+struct cached_file {
+    std::vector<cached_token> tokens;       // including the final T_EOF
+    std::string               text;
+    bool                      has_guard = false;
+    std::string               guard_name;   // include guard macro, as detected by the lexer
+};
+
+class include_cache {
+public:
+    typedef std::shared_ptr<cached_file const> file_ptr;
+
+    // the single cache shared by all contexts in this process
+    static include_cache & instance() {
+        static include_cache cache;
+        return cache;
+    }
+
+    // Return the token stream for a file, lexing it if we haven't seen this version before.
+    // Returns null if the file cannot be read; lexing errors are thrown, to every caller
+    // waiting on the same file.
+    template <typename TokenT>
+    file_ptr get(std::string const & fname, boost::wave::language_support language) {
+        struct stat st;
+        if (::stat(fname.c_str(), &st) != 0) {
+            return file_ptr();
+        }
+        version ver{ std::int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec,
+                     std::int64_t(st.st_size) };
+        key k(fname, language);
+
+        // Look for an up to date entry, or claim the job of creating one.  Lexing happens
+        // outside the lock; other threads wanting the same file wait on its future instead.
+        std::promise<file_ptr> promise;
+        std::shared_future<file_ptr> contents;
+        bool filling = false;
+        std::uint64_t generation = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_entries.find(k);
+            if ((it != m_entries.end()) && (it->second.ver == ver)) {
+                m_hits++;
+                contents = it->second.contents;
+            } else {
+                m_misses++;
+                contents = promise.get_future().share();
+                generation = ++m_generation;
+                m_entries[k] = entry{ver, generation, contents};
+                filling = true;
+            }
+        }
+
+        if (filling) {
+            try {
+                file_ptr file = lex_file<TokenT>(fname, language);
+                if (!file) {
+                    forget(k, generation);
+                }
+                promise.set_value(file);
+            } catch (...) {
+                forget(k, generation);
+                promise.set_exception(std::current_exception());
+            }
+        }
+        return contents.get();
+    }
+
+    std::size_t hits() const   { return m_hits; }
+    std::size_t misses() const { return m_misses; }
+
+private:
+    include_cache() : m_hits(0), m_misses(0) {}
+
+    // files are identified by path; their contents by modification time and size
+    typedef std::pair<std::string, int> key;    // path and language flags
+    struct version {
+        std::int64_t mtime_ns;
+        std::int64_t size;
+        bool operator==(version const & other) const {
+            return (mtime_ns == other.mtime_ns) && (size == other.size);
+        }
+    };
+    struct entry {
+        version                      ver;
+        std::uint64_t                generation;   // identifies who created the entry
+        std::shared_future<file_ptr> contents;
+    };
+
+    // drop a failed entry, unless someone has already replaced it
+    void forget(key const & k, std::uint64_t generation) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find(k);
+        if ((it != m_entries.end()) && (it->second.generation == generation)) {
+            m_entries.erase(it);
+        }
+    }
+
+    template <typename TokenT>
+    static file_ptr lex_file(std::string const & fname, boost::wave::language_support language) {
+        using namespace boost::wave;
+        typedef typename TokenT::position_type position_type;
+
+        mapped_file mapping;
+        if (!mapping.open(fname.c_str())) {
+            return file_ptr();
+        }
+
+        std::unique_ptr<cpplexer::lex_input_interface<TokenT> > lexer(
+            cpplexer::new_lexer_gen<char const *, position_type, TokenT>::new_lexer(
+                mapping.begin(), mapping.end(), position_type(fname.c_str()), language));
+
+        auto file = std::make_shared<cached_file>();
+        file->text.reserve(mapping.size());
+        TokenT tok;
+        while (token_id(lexer->get(tok)) != T_EOI) {
+            auto const & value = tok.get_value();
+            auto const & pos   = tok.get_position();
+            file->tokens.push_back(cached_token{ token_id(tok),
+                                                 std::uint32_t(file->text.size()),
+                                                 std::uint32_t(value.size()),
+                                                 std::uint32_t(pos.get_line()),
+                                                 std::uint32_t(pos.get_column()) });
+            file->text.append(value.data(), value.size());
+        }
+        file->has_guard = lexer->has_include_guards(file->guard_name);
+        return file;
+    }
+
+    std::mutex                 m_mutex;      // protects m_entries
+    std::map<key, entry>       m_entries;
+    std::uint64_t              m_generation = 0;
+    std::atomic<std::size_t>   m_hits;
+    std::atomic<std::size_t>   m_misses;
+};
+
+// "Iterator" over a cached file, used only to select the replay lexer below when Wave
+// constructs a lex_iterator
+struct cached_token_cursor {
+    include_cache::file_ptr file;
+    std::size_t             index;
+};
+
+// Supplies Wave with tokens from a cached file, exactly as the re2c lexer would have
+template <typename TokenT>
+class cached_token_lexer
+    : public boost::wave::cpplexer::lex_input_interface_generator<TokenT> {
+    typedef typename TokenT::position_type position_type;
+    typedef typename TokenT::string_type   string_type;
+public:
+    cached_token_lexer(cached_token_cursor const & first, cached_token_cursor const & last,
+                       position_type const & pos)
+        : m_file(first.file), m_next(first.index), m_end(last.index),
+          m_filename(pos.get_file()), m_line_offset(0) {}
+
+    TokenT & get(TokenT & result) override {
+        if (m_next == m_end) {
+            return result = TokenT();   // T_EOI
+        }
+        cached_token const & t = m_file->tokens[m_next++];
+        return result = TokenT(t.id,
+                               string_type(m_file->text.data() + t.offset, t.length),
+                               position_type(m_filename, t.line + m_line_offset, t.column));
+    }
+
+    // #line directives change the file name and line numbering of the tokens that follow
+    void set_position(position_type const & pos) override {
+        m_filename = pos.get_file();
+        if (m_next != m_end) {
+            m_line_offset = long(pos.get_line()) - long(m_file->tokens[m_next].line);
+        }
+    }
+
+#if BOOST_WAVE_SUPPORT_PRAGMA_ONCE != 0
+    bool has_include_guards(std::string & guard_name) const override {
+        if (m_file->has_guard) {
+            guard_name = m_file->guard_name;
+        }
+        return m_file->has_guard;
+    }
+#endif
+
+private:
+    include_cache::file_ptr m_file;
+    std::size_t             m_next;
+    std::size_t             m_end;
+    string_type             m_filename;
+    long                    m_line_offset;
+};
+
+namespace boost { namespace wave { namespace cpplexer {
+
+// lex_iterator asks new_lexer_gen for a lexer matching the type of its input "iterators"
+template <typename PositionT, typename TokenT>
+struct new_lexer_gen<cached_token_cursor, PositionT, TokenT>
+{
+    static lex_input_interface<TokenT> *
+    new_lexer(cached_token_cursor const &first, cached_token_cursor const &last,
+        PositionT const &pos, boost::wave::language_support)
+    {
+        return new cached_token_lexer<TokenT>(first, last, pos);
+    }
+};
+
+}}}
+
+// An iteration context policy that takes included files from the process-wide cache
+// Nothing needs to be owned by the iteration context: the replay lexer keeps its file alive.
+struct load_file_from_cache
+{
+    template <typename IterContextT>
+    class inner
+    {
+    public:
+        template <typename PositionT>
+        static void init_iterators(IterContextT &iter_ctx,
+            PositionT const &act_pos, boost::wave::language_support language)
+        {
+            using boost::wave::preprocess_exception;
+            typedef typename IterContextT::iterator_type iterator_type;
+            typedef typename iterator_type::token_type   token_type;
+
+            include_cache::file_ptr file =
+                include_cache::instance().get<token_type>(iter_ctx.filename.c_str(), language);
+            if (!file) {
+                BOOST_WAVE_THROW_CTX(iter_ctx.ctx, preprocess_exception,
+                    bad_include_file, iter_ctx.filename.c_str(), act_pos);
+                return;
+            }
+
+            iter_ctx.first = iterator_type(
+                cached_token_cursor{file, 0}, cached_token_cursor{file, file->tokens.size()},
+                PositionT(iter_ctx.filename), language);
+            iter_ctx.last = iterator_type();
+        }
+    };
+};
+
+#endif // INCLUDE_CACHE_HPP
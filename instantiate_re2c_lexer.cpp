@@ -0,0 +1,19 @@
+/**
+ *   Copyright (C) 2015 Jeff Trull <edaskel@att.net>
+ *
+ *   Distributed under the Boost Software License, Version 1.0. (See accompanying
+ *   file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+ *
+ *
+ */
+
+// The Wave library only ships lexers for std::string iterators.  Stage 1 lexes from
+// raw character ranges (memory mapped files, or the data of an in-memory string), so
+// we instantiate the re2c lexer for those here, following the Wave samples.
+
+#include <boost/wave/wave_config.hpp>
+#include <boost/wave/cpplexer/cpp_lex_token.hpp>
+#include <boost/wave/cpplexer/cpp_lex_iterator.hpp>
+#include <boost/wave/cpplexer/re2clex/cpp_re2c_lexer.hpp>
+
+template struct boost::wave::cpplexer::new_lexer_gen<char const *>;
@@ -0,0 +1,71 @@
+/**
+ *   Copyright (C) 2015 Jeff Trull <edaskel@att.net>
+ *
+ *   Distributed under the Boost Software License, Version 1.0. (See accompanying
+ *   file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+ *
+ *
+ */
+
+// The set of conditional macros stage 1 is tracking, with allocation-free lookup by name
+// so the cost of examining a token doesn't grow with the number of macros
+
+#ifndef MACRO_SET_HPP
+#define MACRO_SET_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/utility/string_ref.hpp>
+
+class macro_set {
+public:
+    static std::size_t const npos = std::size_t(-1);
+
+    // duplicates are dropped; indices follow the order of first appearance
+    explicit macro_set(std::vector<std::string> const & names) {
+        m_names.reserve(names.size());
+        for (std::string const & name : names) {
+            if (std::find(m_names.begin(), m_names.end(), name) == m_names.end()) {
+                m_names.push_back(name);
+            }
+        }
+        // index keys refer to m_names, which must not change from here on
+        for (std::size_t i = 0; i < m_names.size(); ++i) {
+            m_index.emplace(boost::string_ref(m_names[i]), i);
+        }
+    }
+
+    macro_set(macro_set const&) = delete;
+    macro_set& operator=(macro_set const&) = delete;
+
+    // index of the named macro, or npos
+    std::size_t find(char const * name, std::size_t len) const {
+        auto it = m_index.find(boost::string_ref(name, len));
+        return (it == m_index.end()) ? npos : it->second;
+    }
+
+    std::size_t size() const { return m_names.size(); }
+    std::string const & name(std::size_t i) const { return m_names[i]; }
+    std::vector<std::string> const & names() const { return m_names; }
+
+private:
+    // FNV-1a
+    struct hasher {
+        std::size_t operator()(boost::string_ref s) const {
+            std::size_t h = 14695981039346656037ull;
+            for (char c : s) {
+                h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+            }
+            return h;
+        }
+    };
+
+    std::vector<std::string>                                      m_names;
+    std::unordered_map<boost::string_ref, std::size_t, hasher>    m_index;
+};
+
+#endif // MACRO_SET_HPP
@@ -0,0 +1,123 @@
+/**
+ *   Copyright (C) 2015 Jeff Trull <edaskel@att.net>
+ *
+ *   Distributed under the Boost Software License, Version 1.0. (See accompanying
+ *   file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+ *
+ *
+ */
+
+// A Wave iteration context policy that lexes input files directly from a read-only
+// memory mapping, instead of first copying them into a std::string as
+// boost::wave::iteration_context_policies::load_file_to_string does
+
+#ifndef MMAP_ITERATION_POLICY_HPP
+#define MMAP_ITERATION_POLICY_HPP
+
+#include <cstddef>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/wave/cpp_exceptions.hpp>
+#include <boost/wave/language_support.hpp>
+
+// RAII owner of a read-only mapping of an entire file
+class mapped_file {
+public:
+    mapped_file() : m_data(nullptr), m_size(0) {}
+    explicit mapped_file(char const * fname) : mapped_file() { open(fname); }
+    ~mapped_file() { close(); }
+
+    mapped_file(mapped_file const&) = delete;
+    mapped_file& operator=(mapped_file const&) = delete;
+    mapped_file(mapped_file && other) : m_data(other.m_data), m_size(other.m_size) {
+        other.m_data = nullptr;
+        other.m_size = 0;
+    }
+    mapped_file& operator=(mapped_file && other) {
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+        return *this;
+    }
+
+    // returns false if the file could not be opened or mapped
+    bool open(char const * fname) {
+        close();
+        int fd = ::open(fname, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        bool ok = (::fstat(fd, &st) == 0) && S_ISREG(st.st_mode);
+        if (ok && (st.st_size > 0)) {
+            void * addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED) {
+                ok = false;
+            } else {
+                m_data = static_cast<char const *>(addr);
+                m_size = st.st_size;
+                // the lexer makes a single forward pass over the contents
+                ::madvise(addr, m_size, MADV_SEQUENTIAL);
+            }
+        }
+        // an empty file is fine - mmap just can't represent it - so leave an empty range
+        ::close(fd);       // the mapping keeps its own reference to the file
+        return ok;
+    }
+
+    void close() {
+        if (m_data) {
+            ::munmap(const_cast<char *>(m_data), m_size);
+            m_data = nullptr;
+            m_size = 0;
+        }
+    }
+
+    char const * begin() const { return m_data; }
+    char const * end()   const { return m_data + m_size; }
+    std::size_t  size()  const { return m_size; }
+
+private:
+    char const * m_data;
+    std::size_t  m_size;
+};
+
+struct load_file_to_mmap
+{
+    // Wave makes the iteration context (of which this is a base) the owner of the input
+    // for each file, and keeps it on its include stack until the lexer reaches the end of
+    // that file.  Each nested #include gets its own context, and thus its own mapping,
+    // which is released when the preprocessor returns to the including file.
+    template <typename IterContextT>
+    class inner
+    {
+    public:
+        template <typename PositionT>
+        static void init_iterators(IterContextT &iter_ctx,
+            PositionT const &act_pos, boost::wave::language_support language)
+        {
+            using boost::wave::preprocess_exception;
+            typedef typename IterContextT::iterator_type iterator_type;
+
+            if (!iter_ctx.mapping.open(iter_ctx.filename.c_str())) {
+                BOOST_WAVE_THROW_CTX(iter_ctx.ctx, preprocess_exception,
+                    bad_include_file, iter_ctx.filename.c_str(), act_pos);
+                return;
+            }
+
+            iter_ctx.first = iterator_type(
+                iter_ctx.mapping.begin(), iter_ctx.mapping.end(),
+                PositionT(iter_ctx.filename), language);
+            iter_ctx.last = iterator_type();
+        }
+
+    private:
+        mapped_file mapping;
+    };
+};
+
+#endif // MMAP_ITERATION_POLICY_HPP
@@ -0,0 +1,283 @@
+/**
+ *   Copyright (C) 2015 Jeff Trull <edaskel@att.net>
+ *
+ *   Distributed under the Boost Software License, Version 1.0. (See accompanying
+ *   file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+ *
+ *
+ */
+
+// Where stage 1 output goes: the rewritten source text, written through a large buffer
+// instead of token by token through iostreams, and an optional NDJSON "sidecar" with one
+// record per lambda hunk so later stages needn't find the delimiters by parsing text
+
+#ifndef OUTPUT_SINK_HPP
+#define OUTPUT_SINK_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "macro_set.hpp"
+
+// append s to out as a quoted JSON string
+inline void append_json_string(std::string & out, std::string const & s) {
+    out += '"';
+    for (char c : s) {
+        switch (c) {
+        case '"':  out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n";  break;
+        case '\t': out += "\\t";  break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char esc[8];
+                std::snprintf(esc, sizeof(esc), "\\u%04x", c);
+                out += esc;
+            } else {
+                out += c;
+            }
+        }
+    }
+    out += '"';
+}
+
+// Accumulates output in a fixed buffer, handing it to a file descriptor or a std::ostream
+// only when full (or on flush)
+class buffered_writer {
+public:
+    // write to a new (truncated) file
+    explicit buffered_writer(std::string const & path, std::size_t capacity = 1 << 20)
+        : m_fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666)), m_stream(nullptr),
+          m_buffer(capacity), m_used(0), m_flushed(0), m_good(m_fd >= 0) {}
+
+    // write to an existing stream, which remains owned by the caller
+    explicit buffered_writer(std::ostream & os, std::size_t capacity = 1 << 16)
+        : m_fd(-1), m_stream(&os),
+          m_buffer(capacity), m_used(0), m_flushed(0), m_good(true) {}
+
+    ~buffered_writer() {
+        flush();
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+    }
+
+    buffered_writer(buffered_writer const&) = delete;
+    buffered_writer& operator=(buffered_writer const&) = delete;
+
+    void write(char const * data, std::size_t n) {
+        if (n > m_buffer.size() - m_used) {
+            drain();
+            if (n >= m_buffer.size()) {
+                emit(data, n);    // too big to be worth copying
+                return;
+            }
+        }
+        std::memcpy(m_buffer.data() + m_used, data, n);
+        m_used += n;
+    }
+    void write(std::string const & s) { write(s.data(), s.size()); }
+
+    // total bytes written so far, including those still buffered
+    std::uint64_t offset() const { return m_flushed + m_used; }
+
+    void flush() {
+        drain();
+        if (m_stream) {
+            m_stream->flush();
+        }
+    }
+
+    bool good() const { return m_good; }
+
+private:
+    void drain() {
+        emit(m_buffer.data(), m_used);
+        m_used = 0;
+    }
+
+    void emit(char const * data, std::size_t n) {
+        m_flushed += n;
+        if (m_stream) {
+            m_stream->write(data, n);
+            return;
+        }
+        while (m_good && n) {
+            ssize_t written = ::write(m_fd, data, n);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                m_good = false;
+            } else {
+                data += written;
+                n -= written;
+            }
+        }
+    }
+
+    int                 m_fd;
+    std::ostream *      m_stream;
+    std::vector<char>   m_buffer;
+    std::size_t         m_used;
+    std::uint64_t       m_flushed;
+    bool                m_good;
+};
+
+// how the lambda delimiters appear in the text
+enum class delimiter_style {
+    markers,     // "BEGIN LAMBDA" and "END LAMBDA" lines
+    lambdas      // the definition of a lambda, "expression_capture_N", and a call to it,
+                 // so the text can be compiled and analyzed by stage 2
+};
+
+// The rewritten source plus hunk records
+// The pp_fsm actions call begin_lambda/end_lambda; the preprocessing hooks keep it
+// informed of the location of the directive being processed, for the records.
+class output_sink {
+public:
+    // text receives the source and delimiters; if hunk_path is non-empty the records are
+    // written there (the file is only created if there is at least one hunk)
+    output_sink(buffered_writer & text,
+                std::shared_ptr<macro_set const> macros,
+                std::string hunk_path = std::string(),
+                delimiter_style style = delimiter_style::markers)
+        : m_text(&text), m_macros(std::move(macros)), m_hunk_path(std::move(hunk_path)),
+          m_style(style), m_lambdas(0), m_file(nullptr), m_line(0) {}
+
+    // records only: text is discarded, and the records have no output offsets
+    output_sink(std::shared_ptr<macro_set const> macros, std::string hunk_path)
+        : m_text(nullptr), m_macros(std::move(macros)), m_hunk_path(std::move(hunk_path)),
+          m_style(delimiter_style::markers), m_lambdas(0), m_file(nullptr), m_line(0) {}
+
+    void write(char const * data, std::size_t n) {
+        if (m_text) {
+            m_text->write(data, n);
+        }
+    }
+
+    // the directive whose events are about to be processed
+    void set_position(char const * file, std::size_t line) {
+        m_file = file;
+        m_line = line;
+    }
+
+    // else_branch: true if the lambda body is the #else of the target conditional
+    void begin_lambda(std::size_t macro, bool else_branch) {
+        std::size_t number = m_lambdas++;
+        if (m_style == delimiter_style::lambdas) {
+            write_lambda("auto expression_capture_", number, " = [&]() -> void {\n");
+        } else {
+            delimiter("BEGIN LAMBDA", macro);
+        }
+        m_open.push_back(hunk{macro, else_branch, m_file ? m_file : "", m_line, offset(), number});
+    }
+
+    void end_lambda(std::size_t macro) {
+        std::uint64_t body_end = offset();
+        for (auto it = m_open.begin(); it != m_open.end(); ++it) {
+            if (it->macro == macro) {
+                if (m_style == delimiter_style::lambdas) {
+                    write_lambda("};\nexpression_capture_", it->number, "();\n");
+                } else {
+                    delimiter("END LAMBDA", macro);
+                }
+                record(*it, body_end);
+                m_open.erase(it);
+                return;
+            }
+        }
+        if (m_style == delimiter_style::markers) {
+            delimiter("END LAMBDA", macro);
+        }
+    }
+
+    void flush() {
+        if (m_text) {
+            m_text->flush();
+        }
+        if (m_hunks) {
+            m_hunks->flush();
+        }
+    }
+
+    bool good() const { return (!m_text || m_text->good()) && (!m_hunks || m_hunks->good()); }
+
+private:
+    struct hunk {
+        std::size_t   macro;
+        bool          else_branch;
+        std::string   file;           // source file and line of the directive opening the body
+        std::size_t   line;
+        std::uint64_t body_begin;     // offset into the output text
+        std::size_t   number;         // lambdas begun before this one
+    };
+
+    std::uint64_t offset() const { return m_text ? m_text->offset() : 0; }
+
+    void delimiter(char const * marker, std::size_t macro) {
+        if (!m_text) {
+            return;
+        }
+        m_text->write(marker, std::strlen(marker));
+        // name the macro if there is any ambiguity
+        if (m_macros && (m_macros->size() > 1)) {
+            m_text->write(" ", 1);
+            m_text->write(m_macros->name(macro));
+        }
+        m_text->write("\n", 1);
+    }
+
+    void write_lambda(char const * before, std::size_t number, char const * after) {
+        if (!m_text) {
+            return;
+        }
+        std::string text = before + std::to_string(number) + after;
+        m_text->write(text);
+    }
+
+    // one line of NDJSON per completed hunk
+    void record(hunk const & h, std::uint64_t body_end) {
+        if (m_hunk_path.empty()) {
+            return;
+        }
+        if (!m_hunks) {
+            m_hunks.reset(new buffered_writer(m_hunk_path, 1 << 16));
+        }
+        std::string rec = "{\"file\":";
+        append_json_string(rec, h.file);
+        rec += ",\"macro\":";
+        append_json_string(rec, m_macros ? m_macros->name(h.macro) : std::string());
+        rec += ",\"branch\":";
+        rec += h.else_branch ? "\"else\"" : "\"then\"";
+        rec += ",\"begin_line\":" + std::to_string(h.line);
+        rec += ",\"end_line\":" + std::to_string(m_line);
+        if (m_text) {
+            rec += ",\"output_begin\":" + std::to_string(h.body_begin);
+            rec += ",\"output_end\":" + std::to_string(body_end);
+        }
+        rec += "}\n";
+        m_hunks->write(rec);
+    }
+
+    buffered_writer *                 m_text;     // null if records only
+    std::shared_ptr<macro_set const>  m_macros;
+    std::string                       m_hunk_path;
+    std::unique_ptr<buffered_writer>  m_hunks;
+    delimiter_style                   m_style;
+    std::size_t                       m_lambdas;  // begun so far, for naming them
+    std::vector<hunk>                 m_open;     // at most one per macro
+    char const *                      m_file;     // current directive location
+    std::size_t                       m_line;
+};
+
+#endif // OUTPUT_SINK_HPP
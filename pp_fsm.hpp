@@ -0,0 +1,174 @@
+/**
+ *   Copyright (C) 2015 Jeff Trull <edaskel@att.net>
+ *
+ *   Distributed under the Boost Software License, Version 1.0. (See accompanying
+ *   file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+ *
+ *
+ */
+
+// The state machine tracking the preprocessor "stack" for one conditional macro
+//
+// States and events are small integers, and the transitions a table computed at compile time,
+// indexed by state, event, and whether we are at the first nesting level of the hunk (the
+// only guard the machine needs).  Dispatching an event is one table lookup.
+
+#ifndef PP_FSM_HPP
+#define PP_FSM_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "output_sink.hpp"
+
+// events
+enum class pp_event : std::uint8_t {
+    condtrue,     // if or ifdef applying to our condition==true, OR "else" of opposite
+    condfalse,    // if or ifdef applying to our condition==false or "else" of opposite
+    tok_if,       // if or ifdef unrelated to our condition
+    tok_elif,     // encountered elif (only when the preprocessor evaluates it)
+    tok_else,     // encountered else
+    tok_endif     // encountered endif
+};
+
+class pp_fsm {
+public:
+    enum state : std::uint8_t {
+        inactive,
+        condtrue_code,       // inside the body of a target hunk whose condition was true
+        condfalse_code,      // inside the body of a target hunk whose condition was false
+        condtrue_else,       // inside the ELSE clause of a target hunk whose condition was true
+        condfalse_elif,      // inside an #elif (and any later branches) after a false condition
+        state_count
+    };
+
+    pp_fsm() : m_stack_depth(0), m_sink(nullptr), m_macro(0), m_state(inactive) {}
+
+    void process_event(pp_event evt) {
+        transition const & t = transitions().rows[index(m_state, evt, m_stack_depth == 1)];
+        // the actions run in this order, as the composite actions below expect
+        if (t.actions & push_stack) {
+            m_stack_depth++;
+        }
+        if (t.actions & pop_stack) {
+            m_stack_depth--;
+        }
+        if ((t.actions & begin_lambda) && m_sink) {
+            // coming from a false condition means the lambda is the body of its #else
+            m_sink->begin_lambda(m_macro, m_state == condfalse_code);
+        }
+        if ((t.actions & end_lambda) && m_sink) {
+            m_sink->end_lambda(m_macro);
+        }
+        m_state = t.next;
+    }
+
+    state current_state() const { return m_state; }
+
+    std::size_t   m_stack_depth;   // counter to remember where we are in the nested PP directives
+    output_sink * m_sink;          // destination for lambda delimiters (same as for the tokens), if any
+    std::size_t   m_macro;         // which of the sink's macros this FSM tracks
+
+private:
+    static constexpr std::size_t event_count = 6;
+
+    // actions
+    enum action : std::uint8_t {
+        none         = 0,
+        push_stack   = 1,
+        pop_stack    = 2,
+        begin_lambda = 4,
+        end_lambda   = 8,
+        // composite actions
+        enter_target = push_stack | begin_lambda,
+        leave_target = pop_stack | end_lambda,
+        empty_target = pop_stack | begin_lambda | end_lambda
+    };
+
+    struct transition {
+        state        next;
+        std::uint8_t actions;
+    };
+
+    static constexpr std::size_t index(state s, pp_event e, bool at_first_level) {
+        return (std::size_t(s) * event_count + std::size_t(e)) * 2 + (at_first_level ? 1 : 0);
+    }
+
+    struct table {
+        transition rows[state_count * event_count * 2];
+    };
+
+    // guard for a row
+    enum level { any, first_level, not_first_level };
+
+    struct row {
+        state    source;
+        pp_event evt;
+        state    next;
+        std::uint8_t actions;
+        level    guard;
+    };
+
+    // Expand the transition table into one entry per state, event and guard value
+    // Anything not listed leaves the state alone and does nothing.
+    static constexpr table build() {
+        // This table assumes we transition into "inactive" on tok_endif from stack depth 1
+        constexpr row transition_table[] = {
+            //  State           Event                Next            Action        Guard
+            {  inactive,       pp_event::condtrue,  condtrue_code,  enter_target, any             },
+            {  condtrue_code,  pp_event::tok_if,    condtrue_code,  push_stack,   any             },
+            {  condtrue_code,  pp_event::tok_endif, condtrue_code,  pop_stack,    not_first_level },
+            {  condtrue_code,  pp_event::tok_endif, inactive,       leave_target, first_level     },
+            {  condtrue_code,  pp_event::tok_else,  condtrue_else,  end_lambda,   first_level     },
+            {  condtrue_code,  pp_event::tok_elif,  condtrue_else,  end_lambda,   first_level     },
+
+            // transitions for if/ifdef/ifndef of target hunk with false condition
+            {  inactive,       pp_event::condfalse, condfalse_code, push_stack,   any             },
+            {  condfalse_code, pp_event::tok_if,    condfalse_code, push_stack,   any             },
+            {  condfalse_code, pp_event::tok_endif, inactive,       empty_target, first_level     },
+            {  condfalse_code, pp_event::tok_endif, condfalse_code, pop_stack,    not_first_level },
+            {  condfalse_code, pp_event::tok_else,  condtrue_code,  begin_lambda, first_level     },
+            // an #elif starts the code for the condition being false, which includes
+            // any later #elif or #else, so those don't end the lambda
+            {  condfalse_code, pp_event::tok_elif,  condfalse_elif, begin_lambda, first_level     },
+
+            {  condfalse_elif, pp_event::tok_if,    condfalse_elif, push_stack,   any             },
+            {  condfalse_elif, pp_event::tok_endif, inactive,       leave_target, first_level     },
+            {  condfalse_elif, pp_event::tok_endif, condfalse_elif, pop_stack,    not_first_level },
+
+            // transitions for ELSE clause of target hunk with true condition
+            {  condtrue_else,  pp_event::tok_if,    condtrue_else,  push_stack,   any             },
+            {  condtrue_else,  pp_event::tok_endif, inactive,       pop_stack,    first_level     },
+            {  condtrue_else,  pp_event::tok_endif, condtrue_else,  pop_stack,    not_first_level },
+
+            // everything else, including all events in the inactive state (discard everything
+            // except our target), is ignored
+        };
+
+        table t{};
+        for (std::size_t s = 0; s < state_count; ++s) {
+            for (std::size_t e = 0; e < event_count; ++e) {
+                for (std::size_t l = 0; l < 2; ++l) {
+                    t.rows[(s * event_count + e) * 2 + l] = transition{state(s), none};
+                }
+            }
+        }
+        for (row const & r : transition_table) {
+            for (std::size_t l = 0; l < 2; ++l) {
+                if ((r.guard == any) || ((r.guard == first_level) == (l == 1))) {
+                    t.rows[index(r.source, r.evt, l == 1)] = transition{r.next, r.actions};
+                }
+            }
+        }
+        return t;
+    }
+
+    static table const & transitions() {
+        static constexpr table t = build();
+        return t;
+    }
+
+    state m_state;
+};
+
+#endif // PP_FSM_HPP
@@ -0,0 +1,138 @@
+/**
+ *   Copyright (C) 2015 Jeff Trull <edaskel@att.net>
+ *
+ *   Distributed under the Boost Software License, Version 1.0. (See accompanying
+ *   file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+ *
+ *
+ */
+
+// A cheap byte-level test for whether a source file could possibly contain a conditional
+// hunk for one of our target macros, used to keep the (much slower) preprocessor away from
+// files that cannot.  It errs on the side of "maybe": anything it lets through still goes
+// to Wave, which has the final say.
+
+#ifndef PREFILTER_HPP
+#define PREFILTER_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "macro_set.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Locate needle[0..n) in [first, last), returning last if absent
+// The SSE2 version compares the first and last characters of the needle against 16
+// candidate positions at once and only does a full comparison where both match.
+inline char const * find_substring(char const * first, char const * last,
+                                   char const * needle, std::size_t n) {
+    if (n == 0) {
+        return first;
+    }
+    if (std::size_t(last - first) < n) {
+        return last;
+    }
+    if (n == 1) {
+        void const * p = std::memchr(first, needle[0], last - first);
+        return p ? static_cast<char const *>(p) : last;
+    }
+
+    char const * p = first;
+    char const * const stop = last - n + 1;    // one past the last possible match start
+#if defined(__SSE2__)
+    __m128i const head = _mm_set1_epi8(needle[0]);
+    __m128i const tail = _mm_set1_epi8(needle[n - 1]);
+    for (; p + 16 <= stop; p += 16) {
+        __m128i const firsts = _mm_loadu_si128(reinterpret_cast<__m128i const *>(p));
+        __m128i const lasts  = _mm_loadu_si128(reinterpret_cast<__m128i const *>(p + n - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(firsts, head),
+                                                        _mm_cmpeq_epi8(lasts, tail)));
+        while (mask) {
+            unsigned const offset = __builtin_ctz(mask);
+            if (std::memcmp(p + offset + 1, needle + 1, n - 2) == 0) {
+                return p + offset;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; p < stop; ++p) {
+        if ((p[0] == needle[0]) && (std::memcmp(p + 1, needle + 1, n - 1) == 0)) {
+            return p;
+        }
+    }
+    return last;
+}
+
+// does the text contain something that looks like #if, #ifdef, or #ifndef?
+inline bool has_conditional_directive(char const * first, char const * last) {
+    for (char const * p = first; p != last; ++p) {
+        p = static_cast<char const *>(std::memchr(p, '#', last - p));
+        if (!p) {
+            return false;
+        }
+        char const * q = p + 1;
+        while ((q != last) && ((*q == ' ') || (*q == '\t'))) {
+            ++q;
+        }
+        if ((last - q >= 2) && (q[0] == 'i') && (q[1] == 'f')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// does the text contain any identifier from the set?
+// One pass over the text with a hash lookup per identifier, for when there are too many
+// macros to search for individually
+inline bool has_identifier_from(char const * first, char const * last, macro_set const & macros) {
+    auto is_ident_start = [](char c) {
+        return ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) || (c == '_');
+    };
+    auto is_ident_char = [&](char c) { return is_ident_start(c) || ((c >= '0') && (c <= '9')); };
+
+    char const * p = first;
+    while (p != last) {
+        if (is_ident_start(*p)) {
+            char const * start = p;
+            while ((p != last) && is_ident_char(*p)) {
+                ++p;
+            }
+            if (macros.find(start, p - start) != macro_set::npos) {
+                return true;
+            }
+        } else if ((*p >= '0') && (*p <= '9')) {
+            // skip numbers entirely so suffixes like 10UL aren't taken for identifiers
+            while ((p != last) && is_ident_char(*p)) {
+                ++p;
+            }
+        } else {
+            ++p;
+        }
+    }
+    return false;
+}
+
+// could this file contain a conditional on any of the given macros?
+inline bool is_candidate(char const * first, char const * last, macro_set const & macros) {
+    if (!has_conditional_directive(first, last)) {
+        return false;
+    }
+    // a vectorized search per macro is fastest for a handful of them
+    if (macros.size() <= 4) {
+        for (std::string const & name : macros.names()) {
+            if (find_substring(first, last, name.data(), name.size()) != last) {
+                return true;
+            }
+        }
+        return false;
+    }
+    return has_identifier_from(first, last, macros);
+}
+
+#endif // PREFILTER_HPP
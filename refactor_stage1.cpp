@@ -8,14 +8,22 @@
  */
 
 #include <iostream>
-
-// Boost Meta State Machine library (for tracking preprocessor "stack")
-#include <boost/msm/front/state_machine_def.hpp>
-#include <boost/msm/back/state_machine.hpp>
-// for the Not_ operator
-#include <boost/msm/front/euml/operator.hpp>
-// for the ActionSequence_ operator
-#include <boost/msm/front/functor_row.hpp>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <set>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <cstdint>
+#include <type_traits>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
 
 // Boost Wave preprocessor library
 #include <boost/wave.hpp>
@@ -24,122 +32,130 @@
 #include <boost/wave/cpplexer/cpp_lex_token.hpp>
 #include <boost/wave/cpplexer/cpp_lex_iterator.hpp>
 
-using namespace boost;
-using boost::msm::front::euml::Not_;
-using boost::msm::front::ActionSequence_;
-using boost::msm::front::Row;
+// for batch mode: reading the compilation database, command line options, output paths
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
 
-// events - currently expecting these to be external (Wave tokens?)
-struct condtrue  {};    // if or ifdef applying to our condition==true, OR "else" of opposite
-struct condfalse {};    // if or ifdef applying to our condition==false or "else" of opposite
-struct tok_if    {};    // if or ifdef unrelated to our condition
-struct tok_else  {};    // encountered else
-struct tok_endif {};    // encountered endif
+// for timing and memory statistics
+#include <sys/resource.h>
 
-struct pp_state : msm::front::state_machine_def<pp_state> {
+#include "mmap_iteration_policy.hpp"
+#include "include_cache.hpp"
+#include "prefilter.hpp"
+#include "macro_set.hpp"
+#include "output_sink.hpp"
+#include "pp_fsm.hpp"
+#include "directive_scanner.hpp"
+#include "region_index.hpp"
+#include "trace.hpp"
+#include "stage1.hpp"
 
-    pp_state() : m_stack_depth(0) {}
+using namespace boost;
 
-    // states
-    struct inactive : msm::front::state<> {};
-    typedef inactive initial_state;
 
-    struct condtrue_code : msm::front::state<> {};
+// Drives one pp_fsm per tracked macro from the conditional directives of a translation unit,
+// in order, however they were found
+// Only FSMs inside one of their hunks ("active") care about unrelated directives, so those
+// are the only ones we send them to; the cost per directive depends on nesting, not on the
+// number of macros.
+class hunk_tracker {
+public:
+    // sink may be null if no output is wanted
+    hunk_tracker(std::shared_ptr<macro_set const> macros, output_sink * sink) :
+        m_macros(std::move(macros)), m_fsms(m_macros->size()) {
+        for (std::size_t i = 0; i < m_fsms.size(); ++i) {
+            m_fsms[i].m_sink = sink;
+            m_fsms[i].m_macro = i;
+        }
+    }
 
-    // inside the body of a target hunk whose condition was false
-    struct condfalse_code : msm::front::state<> {};
+    macro_set const & macros() const { return *m_macros; }
 
-    // inside the ELSE clause of a target hunk whose condition was true
-    struct condtrue_else : msm::front::state<> {};
+    // total events dispatched to the FSMs so far
+    std::size_t events() const { return m_events; }
 
-    // actions
-    // can make the incr/decr a simple lambda?
-    struct push_stack {
-        template<class Event, class Source, class Target>
-        void operator()(Event const&, pp_state& fsm, Source const&, Target const&) {
-            fsm.m_stack_depth++;
-        }
-    };
+    // an #if, #ifdef or #ifndef the preprocessor evaluated
+    // target is the tracked macro it consists of (or macro_set::npos), and true_hunk whether
+    // the code it guards, rather than its #else, becomes the lambda
+    void conditional(std::size_t target, bool true_hunk) {
+        // enter some nested ifdef/if/ifndef, from the point of view of hunks we are already in
+        process_active(pp_event::tok_if);
 
-    struct pop_stack {
-        template<class Source, class Target>
-        void operator()(tok_endif const&, pp_state& fsm, Source const&, Target const&) {
-            fsm.m_stack_depth--;
+        // and possibly the start of a new hunk
+        if ((target != macro_set::npos) && !is_active(target)) {
+            m_events++;
+            if (true_hunk) {
+                // start handling of "true" hunk
+                m_fsms[target].process_event(pp_event::condtrue);
+            } else {
+                // enter "false" hunk handling
+                m_fsms[target].process_event(pp_event::condfalse);
+            }
+            m_active.push_back(target);
         }
-    };
+    }
 
-    struct begin_lambda {
-        template<class Source, class Target, class Event>
-        void operator()(Event const&, pp_state const&, Source const&, Target const&) {
-            // output start of lambda
-            std::cout << "BEGIN LAMBDA\n";
-        }
-    };
+    // an #if, #ifdef or #ifndef in code being skipped
+    void skipped_conditional() {
+        process_active(pp_event::tok_if);
+    }
 
-    struct end_lambda {
-        template<class Source, class Target, class Event>
-        void operator()(Event const&, pp_state const&, Source const&, Target const&) {
-            // output start of lambda
-            std::cout << "END LAMBDA\n";
-        }
-    };
+    // an #elif in a conditional whose enclosing code is being processed, either evaluated or
+    // ending the branch that was taken (no other #elif can matter to an FSM)
+    void elif_directive() {
+        process_active(pp_event::tok_elif);
+    }
 
-    // define composite actions
-    typedef ActionSequence_<mpl::vector<push_stack, begin_lambda> > enter_target;
-    typedef ActionSequence_<mpl::vector<pop_stack,  end_lambda> >   leave_target;
-    typedef ActionSequence_<mpl::vector<pop_stack, begin_lambda, end_lambda> > empty_target;
+    void else_directive() {
+        process_active(pp_event::tok_else);
+    }
 
-    // guards
-    struct first_level {
-        template<class Event, class Source, class Target>
-        bool operator()(Event const&, pp_state const& fsm, Source const&, Target const&) {
-            return fsm.m_stack_depth == 1;
+    void endif_directive() {
+        process_active(pp_event::tok_endif);
+        // FSMs leaving their hunk need no further events
+        m_active.erase(std::remove_if(m_active.begin(), m_active.end(),
+                                      [this](std::size_t i) { return !is_active(i); }),
+                       m_active.end());
+    }
+
+private:
+    bool is_active(std::size_t i) const {
+        return m_fsms[i].m_stack_depth != 0;   // zero only in the "inactive" state
+    }
+
+    void process_active(pp_event evt) {
+        m_events += m_active.size();
+        for (std::size_t i : m_active) {
+            m_fsms[i].process_event(evt);
         }
-    };
+    }
 
-    size_t m_stack_depth;   // counter to remember where we are in the nested PP directives
-
-    // transition table
-    // We need to include internal transitions with counter increment/decrement actions
-    // This table assumes we transition into "inactive" on tok_endif from stack depth 1
-    typedef boost::msm::front::none none;
-    struct transition_table : mpl::vector<
-        //    State           Event      Next            Action        Guard
-        Row < inactive,       condtrue,  condtrue_code,  enter_target, none              >,
-        Row < condtrue_code,  tok_if,    condtrue_code,  push_stack,   none              >,
-        Row < condtrue_code,  tok_endif, condtrue_code,  pop_stack,    Not_<first_level> >,
-        Row < condtrue_code,  tok_endif, inactive,       leave_target, first_level       >,
-        Row < condtrue_code,  tok_else,  condtrue_else,  end_lambda,   first_level       >,
-
-        // transitions for if/ifdef/ifndef of target hunk with false condition
-        Row < inactive,       condfalse, condfalse_code, push_stack,   none              >,
-        Row < condfalse_code, tok_if,    condfalse_code, push_stack,   none              >,
-        Row < condfalse_code, tok_endif, inactive,       empty_target, first_level       >,
-        Row < condfalse_code, tok_endif, condfalse_code, pop_stack,    Not_<first_level> >,
-        Row < condfalse_code, tok_else,  condtrue_code,  begin_lambda, first_level       >,
-
-        // transitions for ELSE clause of target hunk with true condition
-        Row < condtrue_else,  tok_if,    condtrue_else,  push_stack,   none              >,
-        Row < condtrue_else,  tok_endif, inactive,       pop_stack,    first_level       >,
-        Row < condtrue_else,  tok_endif, condtrue_else,  pop_stack,    Not_<first_level> >,
-        Row < condtrue_else,  tok_else,  condtrue_else,  none,         none              >,
-
-        // transitions for inactive state (discard everything except our target)
-        Row < inactive,       tok_if,    inactive,       none,         none              >,
-        Row < inactive,       tok_endif, inactive,       none,         none              >,
-        Row < inactive,       tok_else,  inactive,       none,         none              >
-
-        > {};
-        
+    std::shared_ptr<macro_set const> m_macros;   // the PP definitions whose usage we are trying to track
+    std::vector<pp_fsm>              m_fsms;     // our PP state tracking FSMs, one per macro
+    std::vector<std::size_t>         m_active;   // FSMs currently inside one of their hunks
+    std::size_t                      m_events = 0;
 };
 
-typedef msm::back::state_machine<pp_state> pp_fsm;
+// Whether the code at the current position of a Wave context is being processed, which the
+// context keeps to itself (for its iterators)
+template <typename ContextT>
+struct if_block_status : ContextT {
+    static bool get(ContextT const & ctx) {
+        return (ctx.*(&if_block_status::get_if_block_status))();
+    }
+};
 
+// Preprocessing hooks feeding the conditionals Wave finds to a hunk_tracker
+// and, optionally, recording per-file statistics in a tu_trace
 struct pp_hooks : wave::context_policies::default_preprocessing_hooks {
-    pp_hooks(std::string const & macro_name) :
-        m_macro_name(macro_name) {
-        m_fsm.start();
-    }
+    // sink may be null if no output is wanted; trace if no tracing is
+    pp_hooks(std::shared_ptr<macro_set const> macros, output_sink * sink, tu_trace * trace = nullptr) :
+        m_tracker(std::move(macros), sink), m_sink(sink), m_trace(trace) {}
+
+    pp_hooks(std::string const & macro_name, output_sink * sink = nullptr) :
+        pp_hooks(std::make_shared<macro_set const>(std::vector<std::string>{macro_name}), sink) {}
 
     template <typename ContextT, typename TokenT, typename ContainerT>
     bool
@@ -149,107 +165,1184 @@ struct pp_hooks : wave::context_policies::default_preprocessing_hooks {
                                      bool expression_value) {
         using namespace boost::wave;
 
-        // determine what sort of event, if any, to give to the state machine
-        auto expr = util::impl::as_string(expression);
-        // BOZO use std compare algorithm here
-        std::string expr_s(expr.begin(), expr.end());
-        if (expr_s == m_macro_name) {
-            if ((expression_value && (token_id(directive) == T_PP_IFDEF)) ||
-                (!expression_value && (token_id(directive) == T_PP_IFNDEF))) {
-                // start handling of "true" hunk
-                m_fsm.process_event(condtrue());
-            } else {
-                // enter "false" hunk handling
-                m_fsm.process_event(condfalse());
-            }
-        } else if ((token_id(directive) == T_PP_IFDEF) ||
-                   (token_id(directive) == T_PP_IFNDEF) ||
-                   (token_id(directive) == T_PP_IF)) {
-            // enter some nested ifdef/if/ifndef
-            m_fsm.process_event(tok_if());
+        // determine what sort of event, if any, to give to the state machines
+        if (token_id(directive) == T_PP_ELIF) {
+            locate(directive);
+            m_tracker.elif_directive();
+            return false;
         }
+        if ((token_id(directive) != T_PP_IFDEF) &&
+            (token_id(directive) != T_PP_IFNDEF) &&
+            (token_id(directive) != T_PP_IF)) {
+            return false;    // not handling anything else
+        }
+        locate(directive);
+
+        m_tracker.conditional(tracked_macro(expression),
+                              (expression_value && (token_id(directive) == T_PP_IFDEF)) ||
+                              (!expression_value && (token_id(directive) == T_PP_IFNDEF)));
 
         return false;  // means "do not re-evaluate expression"
     }
 
+    // Wave evaluates an #elif only until a branch is taken, and the one ending the taken
+    // branch is not reported to evaluated_conditional_expression; it is seen only here
+    template <typename ContextT, typename TokenT>
+    bool
+    found_directive(ContextT const& ctx, TokenT const& directive) {
+        if ((boost::wave::token_id(directive) == boost::wave::T_PP_ELIF) && if_block_status<ContextT>::get(ctx)) {
+            locate(directive);
+            m_tracker.elif_directive();
+        }
+        return false;    // process the directive as usual
+    }
+
     template <typename ContextT, typename TokenT>
     void
     skipped_token(ContextT const&, TokenT const& token)
     {
         using namespace boost::wave;
+        if (m_trace) {
+            m_trace->skipped_token();
+        }
         switch (token_id(token)) {
 
         case T_PP_IFDEF:
         case T_PP_IFNDEF:
         case T_PP_IF:
-            m_fsm.process_event(tok_if());
+            locate(token);
+            m_tracker.skipped_conditional();
             break;
 
         case T_PP_ELSE:
-            m_fsm.process_event(tok_else());
+            locate(token);
+            m_tracker.else_directive();
             break;
 
         case T_PP_ENDIF:
-            m_fsm.process_event(tok_endif());
+            locate(token);
+            m_tracker.endif_directive();
             break;
 
         default:
-            break;    // not handling anything else (e.g. elif)
+            break;    // not handling anything else (skipped #elifs aren't reported at all)
         }
     }
 
-    std::string m_macro_name;    // the PP definition whose usage we are trying to track
-    pp_fsm      m_fsm;           // our PP state tracking FSM
+    // the remaining hooks are only of interest for tracing
+
+    template <typename ContextT>
+    bool
+    found_include_directive(ContextT const&, std::string const&, bool) {
+        if (m_trace) {
+            m_trace->include_found();
+        }
+        return false;    // ok to include this file
+    }
+
+    template <typename ContextT>
+    void
+    opened_include_file(ContextT const&, std::string const&, std::string const& absname, bool) {
+        if (m_trace) {
+            m_trace->file_opened(absname, m_tracker.events());
+        }
+    }
+
+    template <typename ContextT>
+    void
+    returning_from_include_file(ContextT const&) {
+        if (m_trace) {
+            m_trace->file_closed(m_tracker.events());
+        }
+    }
+
+    template <typename ContextT, typename TokenT>
+    TokenT const&
+    generated_token(ContextT const&, TokenT const& token) {
+        if (m_trace) {
+            m_trace->token();
+        }
+        return token;
+    }
+
+    // close the trace, if any, when preprocessing is over
+    void finish_trace() {
+        if (m_trace) {
+            m_trace->finish(m_tracker.events());
+        }
+    }
+
+private:
+    // index of the macro a conditional expression consists of, if it is one we track
+    // Looks up the token text in place - no string is built
+    template <typename ContainerT>
+    std::size_t tracked_macro(ContainerT const & expression) const {
+        using namespace boost::wave;
+        typename ContainerT::const_iterator ident = expression.end();
+        for (auto it = expression.begin(); it != expression.end(); ++it) {
+            if (IS_CATEGORY(token_id(*it), WhiteSpaceTokenType) || (token_id(*it) == T_NEWLINE)) {
+                continue;
+            }
+            if ((ident != expression.end()) || (token_id(*it) != T_IDENTIFIER)) {
+                return macro_set::npos;    // not a lone identifier
+            }
+            ident = it;
+        }
+        if (ident == expression.end()) {
+            return macro_set::npos;
+        }
+        auto const & name = ident->get_value();
+        return m_tracker.macros().find(name.data(), name.size());
+    }
+
+    // tell the sink where the directive we are about to report is, for its hunk records
+    template <typename TokenT>
+    void locate(TokenT const & directive) {
+        if (m_sink) {
+            auto const & pos = directive.get_position();
+            m_sink->set_position(pos.get_file().c_str(), pos.get_line());
+        }
+    }
+
+    hunk_tracker  m_tracker;
+    output_sink * m_sink;
+    tu_trace *    m_trace;
 };
 
+extern std::vector<std::string> ipaths;   // compiler-supplied include paths
+extern std::vector<std::string> predefs;  // compiler-supplied predefined macros
+
 typedef boost::wave::cpplexer::lex_token<> token_type;
 typedef boost::wave::cpplexer::lex_iterator<token_type> lex_iterator_type;
-typedef boost::wave::context<std::string::const_iterator, lex_iterator_type,
-            boost::wave::iteration_context_policies::load_file_to_string,
-            pp_hooks
-        > context_type;
+// The main file is supplied as a range of characters, either from a string or a memory mapping
+// Included files are loaded according to InputPolicy
+template <typename InputPolicy>
+using basic_context_type = boost::wave::context<char const *, lex_iterator_type,
+                                                InputPolicy,
+                                                pp_hooks>;
+typedef basic_context_type<load_file_from_cache> context_type;
+typedef basic_context_type<load_file_to_mmap> mmap_context_type;
+typedef basic_context_type<boost::wave::iteration_context_policies::load_file_to_string> string_context_type;
 
-extern std::vector<std::string> ipaths;   // compiler-supplied include paths
-extern std::vector<std::string> predefs;  // compiler-supplied predefined macros
+// Per-TU settings extracted from a compilation database entry
+struct compile_job {
+    boost::filesystem::path  file;          // absolute path of the main source file
+    std::vector<std::string> quote_paths;   // -iquote: searched only for #include ""
+    std::vector<std::string> include_paths; // -I and -isystem, in command line order
+    std::vector<std::string> defines;       // -D, as X or X=Y
+    std::vector<std::string> undefines;     // -U
+};
 
-void try_out_pp(std::string const& corpus) {
-    pp_hooks hooks("TEST_PP_CONDITIONAL");
-    context_type ctx_defined (corpus.begin(), corpus.end(),
-                              "<Unknown>", hooks);
-    
-    // before we parse, set up a few things:
-    // retain comments
-    ctx_defined.set_language(boost::wave::enable_preserve_comments(ctx_defined.get_language()));
-    // predefined macros contain long longs and variadics
-    ctx_defined.set_language(boost::wave::enable_long_long(ctx_defined.get_language()));
-    ctx_defined.set_language(boost::wave::enable_variadics(ctx_defined.get_language()));
-    // find includes
-    ctx_defined.set_sysinclude_delimiter();
+// The compiler's predefined macros, parsed once from their "X=Y" form into a table of
+// tokens that can simply be copied into each new context.  With several hundred
+// predefined macros, parsing them per context dominated setup for small files.
+template <typename ContextT>
+class predefined_macro_table {
+    typedef typename ContextT::token_type          token_type;
+    typedef typename ContextT::token_sequence_type token_sequence_type;
+    typedef typename ContextT::position_type       position_type;
+public:
+    explicit predefined_macro_table(boost::wave::language_support language)
+        : m_language(language) {
+        // let Wave parse each definition into a scratch context, then read back the results
+        static char const nothing[] = "";
+        ContextT seed(nothing, nothing, "<predefined>", pp_hooks(""));
+        seed.set_language(language);
+        for (std::string const& predef : predefs) {
+            if (!seed.add_macro_definition(predef, true)) {
+                continue;    // rejected (e.g. one of Wave's own) - and would be each time
+            }
+            std::string name = predef.substr(0, predef.find_first_of("=("));
+            macro m;
+            bool is_predefined;
+            position_type pos;
+            if (seed.get_macro_definition(name, m.has_params, is_predefined, pos,
+                                          m.parameters, m.definition)) {
+                m.name = token_type(boost::wave::T_IDENTIFIER, name.c_str(), pos);
+                m_macros.push_back(std::move(m));
+            }
+        }
+    }
+
+    void apply(ContextT & ctx) const {
+        for (macro const & m : m_macros) {
+            // add_macro_definition wants to own these
+            std::vector<token_type> parameters(m.parameters);
+            token_sequence_type     definition(m.definition);
+            ctx.add_macro_definition(m.name, m.has_params, parameters, definition, true);
+        }
+    }
+
+    boost::wave::language_support language() const { return m_language; }
+
+private:
+    struct macro {
+        token_type              name;
+        bool                    has_params;
+        std::vector<token_type> parameters;
+        token_sequence_type     definition;
+    };
+    boost::wave::language_support m_language;
+    std::vector<macro>            m_macros;
+};
+
+// the predefined macro table for the calling thread
+// Wave tokens cannot be shared across threads (see include_cache.hpp) so each has its own
+template <typename ContextT>
+predefined_macro_table<ContextT> const & predefined_macros(boost::wave::language_support language) {
+    static thread_local std::unique_ptr<predefined_macro_table<ContextT> > table;
+    if (!table || (table->language() != language)) {
+        table.reset(new predefined_macro_table<ContextT>(language));
+    }
+    return *table;
+}
+
+// settings common to every context: language options and the compiler's own paths and macros
+// quote_paths and include_paths are added in front of the compiler-supplied ones, as gcc would
+template <typename ContextT>
+void configure_context(ContextT & ctx,
+                       std::vector<std::string> const & quote_paths = {},
+                       std::vector<std::string> const & include_paths = {}) {
+    using namespace boost::wave;
+    // retain comments; predefined macros contain long longs and variadics
+    // (set all at once: each set_language resets the macro table)
+    ctx.set_language(enable_variadics(enable_long_long(enable_preserve_comments(ctx.get_language()))));
+    // find includes the way gcc does: "" searches the current directory, then the quote paths,
+    // then everything else; <> only the latter
+    for (std::string const& qpath : quote_paths) {
+        ctx.add_include_path(qpath.c_str());
+    }
+    for (std::string const& ipath : include_paths) {
+        ctx.add_sysinclude_path(ipath.c_str());
+    }
     // use generated data from our compiler to seed include paths:
     for (std::string const& ipath : ipaths) {
-        ctx_defined.add_include_path(ipath.c_str());
+        ctx.add_sysinclude_path(ipath.c_str());
     }
     // supply predefined macros too
-    for (std::string const& predef : predefs) {
-        ctx_defined.add_macro_definition(predef, true);
-    }
-    // enable test ifdef
-    ctx_defined.add_macro_definition("TEST_PP_CONDITIONAL");
+    predefined_macros<ContextT>(ctx.get_language()).apply(ctx);
+}
 
+// iterate over the non-skipped tokens of a configured context, copying them to "out"
+// (the same sink its hooks were given); returns false, after describing the problem on
+// "err", if Wave could not finish
+template <typename ContextT>
+bool preprocess(ContextT & ctx, output_sink & out, std::ostream & err) {
     using boost::wave::preprocess_exception;
     try {
-        // iterate over the non-skipped tokens
         // this process will execute our code:
-        for (token_type const& t : ctx_defined) {
-            std::cout << t.get_value();  // this one was not skipped and we copy it to the output
+        for (token_type const& t : ctx) {
+            // this one was not skipped and we copy it to the output
+            auto const & value = t.get_value();
+            out.write(value.data(), value.size());
         }
+        out.flush();
     } catch (preprocess_exception const& e) {
-        std::cerr << "parse failed on line " << e.line_no() << " of file " << e.file_name();
-        std::cerr << ": " << preprocess_exception::error_text(e.get_errorcode()) << "\n";
+        out.flush();    // keep what we have in order with the diagnostic
+        err << "parse failed on line " << e.line_no() << " of file " << e.file_name();
+        err << ": " << preprocess_exception::error_text(e.get_errorcode()) << "\n";
+        return false;
+    } catch (boost::wave::cpp_exception const& e) {
+        // e.g. lexing errors
+        out.flush();
+        err << "parse failed on line " << e.line_no() << " of file " << e.file_name();
+        err << ": " << e.description() << "\n";
+        return false;
+    }
+    return true;
+}
+
+void try_out_pp(std::string const& corpus) {
+    auto macros = std::make_shared<macro_set const>(std::vector<std::string>{"TEST_PP_CONDITIONAL"});
+    buffered_writer text(std::cout);
+    output_sink sink(text, macros);
+    pp_hooks hooks(macros, &sink);
+    context_type ctx_defined (corpus.data(), corpus.data() + corpus.size(),
+                              "<Unknown>", hooks);
+    
+    // before we parse, set up a few things:
+    configure_context(ctx_defined);
+    // enable test ifdef
+    ctx_defined.add_macro_definition("TEST_PP_CONDITIONAL");
+
+    preprocess(ctx_defined, sink, std::cerr);
+}
+
+// Turn a compile command (file, working directory and arguments, the first being the
+// compiler) into a compile_job
+// Only the options that influence preprocessing are retained
+compile_job make_job(std::string const & file,
+                     boost::filesystem::path const & directory,
+                     std::vector<std::string> const & args) {
+    namespace fs = boost::filesystem;
+
+    compile_job job;
+    job.file = fs::absolute(file, directory).lexically_normal();
+
+    auto in_dir = [&directory](std::string const & p) {
+        return fs::absolute(p, directory).lexically_normal().string();
+    };
+    for (std::size_t i = 1; i < args.size(); ++i) {
+        std::string const & arg = args[i];
+        // options take their value either attached ("-Ifoo") or as the next argument ("-I foo")
+        auto value = [&](std::string const & opt) -> std::string {
+            if (arg.size() > opt.size()) {
+                return arg.substr(opt.size());
+            }
+            return (i + 1 < args.size()) ? args[++i] : std::string();
+        };
+        if (arg.compare(0, 7, "-iquote") == 0) {
+            job.quote_paths.push_back(in_dir(value("-iquote")));
+        } else if (arg.compare(0, 8, "-isystem") == 0) {
+            job.include_paths.push_back(in_dir(value("-isystem")));
+        } else if (arg.compare(0, 2, "-I") == 0) {
+            job.include_paths.push_back(in_dir(value("-I")));
+        } else if (arg.compare(0, 2, "-D") == 0) {
+            job.defines.push_back(value("-D"));
+        } else if (arg.compare(0, 2, "-U") == 0) {
+            job.undefines.push_back(value("-U"));
+        }
+    }
+    return job;
+}
+
+// the same for one compile_commands.json entry
+compile_job make_job(boost::property_tree::ptree const & entry) {
+    std::vector<std::string> args;
+    if (auto arguments = entry.get_child_optional("arguments")) {
+        for (auto const & arg : *arguments) {
+            args.push_back(arg.second.data());
+        }
+    } else {
+        args = boost::program_options::split_unix(entry.get_child("command").data());
+    }
+    return make_job(entry.get_child("file").data(),
+                    entry.get<std::string>("directory", "."),
+                    args);
+}
+
+// read a compilation database, keeping one job per distinct source file
+std::vector<compile_job> read_compilation_database(boost::filesystem::path const & db_file) {
+    boost::property_tree::ptree db;
+    boost::property_tree::read_json(db_file.string(), db);
+
+    std::vector<compile_job> jobs;
+    std::set<boost::filesystem::path> seen;
+    for (auto const & entry : db) {
+        compile_job job = make_job(entry.second);
+        if (seen.insert(job.file).second) {
+            jobs.push_back(std::move(job));
+        }
+    }
+    return jobs;
+}
+
+// where the preprocessed version of a source file goes: its full path, re-rooted under out_dir
+boost::filesystem::path output_path(boost::filesystem::path const & out_dir,
+                                    boost::filesystem::path const & source) {
+    return out_dir / source.relative_path();
+}
+
+// where the hunk records for an output file go
+std::string hunk_path(boost::filesystem::path const & out_file) {
+    return out_file.string() + ".hunks.ndjson";
+}
+
+// how input files (the main file and all headers) get from disk to the lexer
+enum class input_policy { cached, mmap, string };
+
+// how hunks are found: by preprocessing with Wave, producing the rewritten source, or by
+// scanning directives alone, producing only the hunk records
+enum class stage1_engine { wave, directives };
+
+// settings shared by every translation unit in a batch
+struct batch_options {
+    std::shared_ptr<macro_set const> macros; // the conditionals we are turning into lambdas
+    boost::filesystem::path  out_dir;       // root of the output tree
+    unsigned                 thread_count;
+    input_policy             input;
+    bool                     prefilter;     // send only files mentioning the macro to Wave
+    stage1_engine            engine;
+    trace_log *              trace;         // if non-null, record per-file statistics here
+};
+
+// accumulated over a batch, from all threads
+struct batch_stats {
+    std::atomic<std::size_t>   failures{0};
+    std::atomic<std::size_t>   preprocessed{0};
+    std::atomic<std::size_t>   skipped{0};        // rejected by the prefilter and copied unchanged
+    std::atomic<std::int64_t>  preprocess_ns{0};  // total time spent in Wave
+    std::atomic<std::int64_t>  prefilter_ns{0};   // total time spent scanning
+    std::atomic<std::size_t>   scanned{0};        // handled by the directive engine
+    std::atomic<std::size_t>   fallbacks{0};      // the directive engine needed Wave's help
+    std::atomic<std::int64_t>  scan_ns{0};        // total time spent in the directive engine
+};
+
+// the contents of a main file, held the way the input policy wants
+template <typename InputPolicy>
+struct main_file_input {
+    bool open(boost::filesystem::path const & fname) { return m_mapping.open(fname.c_str()); }
+    char const * begin() const { return m_mapping.begin(); }
+    char const * end()   const { return m_mapping.end(); }
+private:
+    mapped_file m_mapping;
+};
+
+template <>
+struct main_file_input<boost::wave::iteration_context_policies::load_file_to_string> {
+    bool open(boost::filesystem::path const & fname) {
+        std::ifstream in(fname.string(), std::ios::binary);
+        m_contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        return in.good() || in.eof();
+    }
+    char const * begin() const { return m_contents.data(); }
+    char const * end()   const { return m_contents.data() + m_contents.size(); }
+private:
+    std::string m_contents;
+};
+
+// run Wave over a translation unit whose main file holds [first, last), sending the result
+// to "out" and, if log is non-null, its statistics to the log
+template <typename ContextT>
+bool preprocess_tu(compile_job const & job,
+                   char const * first, char const * last,
+                   std::shared_ptr<macro_set const> const & macros,
+                   output_sink & out,
+                   trace_log * log,
+                   std::ostream & err) {
+    // time this file and everything it includes, if asked
+    std::unique_ptr<tu_trace> trace;
+    if (log) {
+        trace.reset(new tu_trace(*log, job.file.string()));
+    }
+
+    pp_hooks hooks(macros, &out, trace.get());
+    ContextT ctx(first, last, job.file.string().c_str(), hooks);
+    configure_context(ctx, job.quote_paths, job.include_paths);
+    try {
+        for (std::string const & def : job.defines) {
+            ctx.add_macro_definition(def);
+        }
+        for (std::string const & undef : job.undefines) {
+            ctx.remove_macro_definition(undef);
+        }
+    } catch (boost::wave::cpp_exception const& e) {
+        err << job.file.string() << ": bad command line macro: " << e.description() << "\n";
+        return false;
+    }
+
+    bool ok = preprocess(ctx, out, err);
+    ctx.get_hooks().finish_trace();
+    return ok;
+}
+
+// preprocess a single translation unit from the database into its own output file
+// everything (hooks, FSM, Wave context, output stream) is private to this call,
+// so any number of these can run concurrently
+template <typename ContextT>
+bool preprocess_job(compile_job const & job,
+                    batch_options const & opts,
+                    std::ostream & err) {
+    namespace fs = boost::filesystem;
+
+    main_file_input<typename ContextT::input_policy_type> corpus;
+    if (!corpus.open(job.file)) {
+        err << "could not open " << job.file << "\n";
+        return false;
+    }
+
+    fs::path out_file = output_path(opts.out_dir, job.file);
+    boost::system::error_code ec;
+    fs::create_directories(out_file.parent_path(), ec);
+    // hunk records go alongside the output, as a sidecar file created only if needed
+    std::string hunk_file = hunk_path(out_file);
+    fs::remove(hunk_file, ec);     // in case of an earlier run
+    // standing in for the directive engine, only the records are wanted
+    std::unique_ptr<buffered_writer> text;
+    std::unique_ptr<output_sink> sink;
+    if (opts.engine == stage1_engine::directives) {
+        sink.reset(new output_sink(opts.macros, hunk_file));
+    } else {
+        text.reset(new buffered_writer(out_file.string()));
+        if (!text->good()) {
+            err << "could not create " << out_file << "\n";
+            return false;
+        }
+        sink.reset(new output_sink(*text, opts.macros, hunk_file));
+    }
+    output_sink & out = *sink;
+
+    if (!preprocess_tu<ContextT>(job, corpus.begin(), corpus.end(), opts.macros, out, opts.trace, err)) {
+        return false;
+    }
+    if (!out.good()) {
+        err << "could not write " << out_file << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Check a job's main file with the prefilter.  If it cannot contain any of our hunks,
+// copy it unchanged to its output location and return true; otherwise return false
+// so the caller sends it through Wave as usual
+bool pass_through_job(compile_job const & job,
+                      batch_options const & opts,
+                      std::ostream & err,
+                      bool & ok) {
+    namespace fs = boost::filesystem;
+
+    mapped_file source;
+    if (!source.open(job.file.c_str()) ||
+        is_candidate(source.begin(), source.end(), *opts.macros)) {
+        return false;    // let preprocess_job report any problem with the file
+    }
+
+    fs::path out_file = output_path(opts.out_dir, job.file);
+    boost::system::error_code ec;
+    fs::create_directories(out_file.parent_path(), ec);
+    fs::remove(hunk_path(out_file), ec);    // no hunks, so no records
+    if (opts.engine == stage1_engine::directives) {
+        ok = true;     // and that's all we produce
+        return true;
+    }
+    std::ofstream out(out_file.string(), std::ios::binary);
+    out.write(source.begin(), source.size());
+    ok = out.good();
+    if (!ok) {
+        err << "could not write " << out_file << "\n";
+    }
+    return true;
+}
+
+// Stage 1 for the fused driver (see stage1.hpp): the same work as pass_through_job or
+// preprocess_job with the default (cached) input policy, but into memory, and with the
+// hunks written as lambdas rather than marked
+stage1_result stage1_preprocess(std::string const & file,
+                                std::string const & directory,
+                                std::vector<std::string> const & args,
+                                std::vector<std::string> const & macros,
+                                std::string & text,
+                                std::string & errors) {
+    // nothing may escape to a caller built without exceptions
+    try {
+        compile_job job = make_job(file, directory, args);
+        auto macro_list = std::make_shared<macro_set const>(macros);
+
+        mapped_file corpus;
+        if (!corpus.open(job.file.c_str())) {
+            errors = "could not open " + job.file.string() + "\n";
+            return stage1_result::failed;
+        }
+        if (!is_candidate(corpus.begin(), corpus.end(), *macro_list)) {
+            return stage1_result::unchanged;
+        }
+
+        std::ostringstream os, err;
+        bool ok;
+        {
+            buffered_writer writer(os);
+            output_sink sink(writer, macro_list, std::string(), delimiter_style::lambdas);
+            ok = preprocess_tu<context_type>(job, corpus.begin(), corpus.end(), macro_list,
+                                             sink, nullptr, err);
+        }
+        errors = err.str();
+        if (!ok) {
+            return stage1_result::failed;
+        }
+        text = os.str();
+        return stage1_result::rewritten;
+    } catch (std::exception const & e) {
+        errors = file + ": " + e.what() + "\n";
+        return stage1_result::failed;
+    }
+}
+
+// The directive engine
+// Hunk discovery needs only the conditional structure of a file, not its expansion.  Here
+// the directives of a main file are found with a light scan (see directive_scanner.hpp) and
+// fed to the same hunk_tracker Wave would drive.  Conditionals must still be evaluated where
+// they decide whether a tracked conditional is reached; that works for literals and tracked
+// macros, whose settings come from the command line and the file itself.  Anything else (a
+// value from a header, say) is left to Wave.  Included files are not followed.
+
+enum class tristate { no, yes, unknown };
+
+tristate operator!(tristate a) {
+    return (a == tristate::unknown) ? a : ((a == tristate::yes) ? tristate::no : tristate::yes);
+}
+tristate operator&&(tristate a, tristate b) {
+    if ((a == tristate::no) || (b == tristate::no)) {
+        return tristate::no;
+    }
+    return ((a == tristate::yes) && (b == tristate::yes)) ? tristate::yes : tristate::unknown;
+}
+tristate operator||(tristate a, tristate b) {
+    return !(!a && !b);
+}
+
+// what the directive engine knows about a tracked macro at some point in a file
+struct macro_state {
+    bool      defined = false;
+    bool      value_known = true;   // whether it has a simple integer value, for #if
+    long long value = 0;
+};
+
+// parse an integer literal, as it would appear in a definition or #if
+bool parse_integer(boost::string_ref text, long long & value) {
+    std::string s(text.data(), text.size());
+    if (s.empty() || !std::isdigit(static_cast<unsigned char>(s[0]))) {
+        return false;
+    }
+    char * end = nullptr;
+    value = std::strtoll(s.c_str(), &end, 0);
+    return std::strspn(end, "uUlL") == std::strlen(end);
+}
+
+// the leading identifier of some directive arguments
+boost::string_ref leading_identifier(boost::string_ref text) {
+    std::size_t n = 0;
+    while ((n < text.size()) &&
+           (std::isalnum(static_cast<unsigned char>(text[n])) || (text[n] == '_'))) {
+        ++n;
+    }
+    return text.substr(0, n);
+}
+
+// "X", "X=Y", or the text of a #define, applied to the tracked macros
+void define_macro(std::vector<macro_state> & states, macro_set const & macros,
+                  boost::string_ref name, boost::string_ref definition, bool function_like) {
+    std::size_t i = macros.find(name.data(), name.size());
+    if (i == macro_set::npos) {
+        return;
+    }
+    states[i].defined = true;
+    states[i].value_known = !function_like && parse_integer(definition, states[i].value);
+}
+
+void define_macro(std::vector<macro_state> & states, macro_set const & macros,
+                  std::string const & def) {
+    std::size_t eq = def.find('=');
+    if (eq == std::string::npos) {
+        define_macro(states, macros, def, "1", false);     // as for -DX
+    } else {
+        boost::string_ref name(def.data(), def.find_first_of("=("));
+        define_macro(states, macros, name, boost::string_ref(def).substr(eq + 1),
+                     def[name.size()] == '(');
+    }
+}
+
+// the tracked macros as a job starts: predefined, then as set on the command line
+std::vector<macro_state> initial_macro_states(compile_job const & job, macro_set const & macros) {
+    std::vector<macro_state> states(macros.size());
+    for (std::string const & predef : predefs) {
+        define_macro(states, macros, predef);
+    }
+    for (std::string const & def : job.defines) {
+        define_macro(states, macros, def);
+    }
+    for (std::string const & undef : job.undefines) {
+        std::size_t i = macros.find(undef.data(), undef.size());
+        if (i != macro_set::npos) {
+            states[i] = macro_state();
+        }
+    }
+    return states;
+}
+
+// one conditional directive, for replay into a hunk_tracker
+struct directive_event {
+    enum kind_type { conditional, skipped_conditional, elif_directive, else_directive, endif_directive };
+    kind_type   kind;
+    std::size_t target;       // for conditional: the tracked macro it tests, if any
+    bool        true_hunk;
+    std::size_t line;
+};
+
+// Scan a main file for the events Wave would produce, as far as that is possible without it
+// Returns false if some conditional needed for the answer could not be evaluated here
+bool scan_conditionals(char const * first, char const * last,
+                       compile_job const & job, macro_set const & macros,
+                       std::vector<directive_event> & events) {
+    std::vector<macro_state> states = initial_macro_states(job, macros);
+
+    // value of a #if or #elif expression
+    auto evaluate = [&](boost::string_ref expr) {
+        bool negate = false;
+        while (!expr.empty() && ((expr[0] == '!') || (expr[0] == ' '))) {
+            negate ^= (expr[0] == '!');
+            expr.remove_prefix(1);
+        }
+        tristate result = tristate::unknown;
+        long long value;
+        boost::string_ref ident = leading_identifier(expr);
+        if (parse_integer(expr, value)) {
+            result = value ? tristate::yes : tristate::no;
+        } else if (ident == "defined") {
+            // defined X, defined(X)
+            expr.remove_prefix(ident.size());
+            while (!expr.empty() && ((expr[0] == ' ') || (expr[0] == '('))) {
+                expr.remove_prefix(1);
+            }
+            boost::string_ref name = leading_identifier(expr);
+            expr.remove_prefix(name.size());
+            while (!expr.empty() && ((expr[0] == ' ') || (expr[0] == ')'))) {
+                expr.remove_prefix(1);
+            }
+            std::size_t i = macros.find(name.data(), name.size());
+            if (expr.empty() && (i != macro_set::npos)) {
+                result = states[i].defined ? tristate::yes : tristate::no;
+            }
+        } else if (ident.size() == expr.size()) {
+            std::size_t i = macros.find(ident.data(), ident.size());
+            if (ident == "true") {
+                result = tristate::yes;
+            } else if (ident == "false") {
+                result = tristate::no;
+            } else if (i != macro_set::npos) {
+                if (!states[i].defined) {
+                    result = tristate::no;
+                } else if (states[i].value_known) {
+                    result = states[i].value ? tristate::yes : tristate::no;
+                }
+            }
+        }
+        return negate ? !result : result;
+    };
+
+    // one entry per open conditional
+    struct frame {
+        tristate enclosing;   // whether the code around the conditional is being processed
+        tristate taken;       // whether some earlier branch was
+        tristate state;       // whether the current branch is
+        bool     tracked;     // whether it tests one of our macros
+    };
+    std::vector<frame> open;
+    auto current = [&]() { return open.empty() ? tristate::yes : open.back().state; };
+
+    bool complete = for_each_directive(first, last,
+        [&](directive const & d) {
+            directive_kind const kind = d.kind;
+            boost::string_ref const args = d.args;
+            std::size_t const line = d.line;
+            tristate here = current();
+            switch (kind) {
+            case directive_kind::if_:
+            case directive_kind::ifdef:
+            case directive_kind::ifndef: {
+                // only a lone identifier makes a conditional one of ours
+                std::size_t target = macro_set::npos;
+                if (leading_identifier(args).size() == args.size()) {
+                    target = macros.find(args.data(), args.size());
+                }
+                tristate value;
+                if (kind == directive_kind::if_) {
+                    value = evaluate(args);
+                } else {
+                    std::size_t i = macros.find(args.data(), args.size());
+                    value = (i == macro_set::npos) ? tristate::unknown
+                          : (states[i].defined ? tristate::yes : tristate::no);
+                    if (kind == directive_kind::ifndef) {
+                        value = !value;
+                    }
+                }
+
+                if (here == tristate::yes) {
+                    bool defined = (target != macro_set::npos) && states[target].defined;
+                    bool true_hunk = ((kind == directive_kind::ifdef) && defined) ||
+                                     ((kind == directive_kind::ifndef) && !defined);
+                    events.push_back(directive_event{directive_event::conditional, target, true_hunk, line});
+                } else if ((here == tristate::unknown) && (target != macro_set::npos)) {
+                    return false;    // Wave may or may not evaluate this one
+                } else {
+                    events.push_back(directive_event{directive_event::skipped_conditional, 0, false, line});
+                }
+                open.push_back(frame{here, value, here && value, target != macro_set::npos});
+                break;
+            }
+
+            case directive_kind::elif: {
+                if (open.empty()) {
+                    return false;    // Wave will want to complain
+                }
+                frame & f = open.back();
+                // the #elifs Wave reports: those it evaluates, and the one ending the taken
+                // branch; which ones they are only matters (to an FSM at the first level of
+                // its hunk) for one of ours
+                if (f.enclosing == tristate::yes) {
+                    tristate reported = !f.taken || f.state;
+                    if (reported == tristate::yes) {
+                        events.push_back(directive_event{directive_event::elif_directive, 0, false, line});
+                    } else if ((reported == tristate::unknown) && f.tracked) {
+                        return false;
+                    }
+                }
+                tristate branch = !f.taken && evaluate(args);
+                f.taken = f.taken || branch;
+                f.state = f.enclosing && branch;
+                break;
+            }
+
+            case directive_kind::else_:
+                if (open.empty()) {
+                    return false;
+                }
+                events.push_back(directive_event{directive_event::else_directive, 0, false, line});
+                open.back().state = open.back().enclosing && !open.back().taken;
+                open.back().taken = tristate::yes;
+                break;
+
+            case directive_kind::endif:
+                if (open.empty()) {
+                    return false;
+                }
+                events.push_back(directive_event{directive_event::endif_directive, 0, false, line});
+                open.pop_back();
+                break;
+
+            case directive_kind::define:
+            case directive_kind::undef: {
+                boost::string_ref name = leading_identifier(args);
+                if ((here == tristate::no) || (macros.find(name.data(), name.size()) == macro_set::npos)) {
+                    break;
+                }
+                if (here == tristate::unknown) {
+                    return false;    // can't tell if it takes effect
+                }
+                if (kind == directive_kind::undef) {
+                    states[macros.find(name.data(), name.size())] = macro_state();
+                    break;
+                }
+                boost::string_ref definition = args.substr(name.size());
+                bool function_like = !definition.empty() && (definition[0] == '(');
+                while (!definition.empty() && (definition[0] == ' ')) {
+                    definition.remove_prefix(1);
+                }
+                define_macro(states, macros, name, definition, function_like);
+                break;
+            }
+
+            case directive_kind::line:
+            case directive_kind::error:
+                // these change positions or stop preprocessing: let Wave handle them
+                return here == tristate::no;
+
+            case directive_kind::include:
+            case directive_kind::other:
+                break;
+            }
+            return true;
+        });
+
+    return complete && open.empty();
+}
+
+// Find a job's hunks with the directive engine, writing just their records
+// Returns false, having written nothing, if the file needs Wave after all
+bool discover_job(compile_job const & job,
+                  batch_options const & opts,
+                  std::ostream & err,
+                  bool & ok) {
+    namespace fs = boost::filesystem;
+
+    mapped_file source;
+    std::vector<directive_event> events;
+    if (!source.open(job.file.c_str()) ||
+        !scan_conditionals(source.begin(), source.end(), job, *opts.macros, events)) {
+        return false;    // let preprocess_job report any problem with the file
+    }
+
+    fs::path out_file = output_path(opts.out_dir, job.file);
+    boost::system::error_code ec;
+    fs::create_directories(out_file.parent_path(), ec);
+    std::string hunk_file = hunk_path(out_file);
+    fs::remove(hunk_file, ec);
+
+    output_sink out(opts.macros, hunk_file);
+    hunk_tracker tracker(opts.macros, &out);
+    std::string const file = job.file.string();
+    for (directive_event const & e : events) {
+        out.set_position(file.c_str(), e.line);
+        switch (e.kind) {
+        case directive_event::conditional:
+            tracker.conditional(e.target, e.true_hunk);
+            break;
+        case directive_event::skipped_conditional:
+            tracker.skipped_conditional();
+            break;
+        case directive_event::elif_directive:
+            tracker.elif_directive();
+            break;
+        case directive_event::else_directive:
+            tracker.else_directive();
+            break;
+        case directive_event::endif_directive:
+            tracker.endif_directive();
+            break;
+        }
+    }
+    out.flush();
+    ok = out.good();
+    if (!ok) {
+        err << "could not write " << hunk_file << "\n";
+    }
+    return true;
+}
+
+// The region index
+// Built from the batch's main files and the project headers they include, which are found
+// using each job's own -iquote/-I paths (not the compiler's, so system headers are left out).
+// Files already in an existing index are rescanned only if they have changed, but the
+// includes of every file reached are resolved again, so an update finds the same files as a
+// full rebuild.
+
+struct index_stats {
+    std::size_t scanned = 0;
+    std::size_t reused = 0;
+};
+
+// where the #includes of a file are looked for (besides its own directory)
+struct include_search {
+    std::vector<std::string> quote_paths;
+    std::vector<std::string> include_paths;
+
+    static include_search of(compile_job const & job) {
+        return include_search{job.quote_paths, job.include_paths};
+    }
+
+    // as recorded in the index: one path per line, after "q" or "I"
+    std::string encode() const {
+        std::string text;
+        for (std::string const & dir : quote_paths) {
+            text += "q" + dir + "\n";
+        }
+        for (std::string const & dir : include_paths) {
+            text += "I" + dir + "\n";
+        }
+        return text;
+    }
+
+    static include_search decode(boost::string_ref text) {
+        include_search search;
+        for_each_line(text, [&search](boost::string_ref line) {
+            if (line.size() > 1) {
+                ((line[0] == 'q') ? search.quote_paths : search.include_paths).push_back(line.substr(1).to_string());
+            }
+        });
+        return search;
+    }
+
+    // call f with each line of text
+    template <typename F>
+    static void for_each_line(boost::string_ref text, F f) {
+        while (!text.empty()) {
+            std::size_t end = std::min(text.find('\n'), text.size());
+            f(text.substr(0, end));
+            text.remove_prefix(std::min(end + 1, text.size()));
+        }
+    }
+};
+
+// the file an #include refers to, or an empty string if it can't be found (or is computed)
+std::string resolve_include(std::string const & spec, boost::filesystem::path const & includer,
+                            include_search const & search) {
+    namespace fs = boost::filesystem;
+    if ((spec.size() < 2) || ((spec[0] != '"') && (spec[0] != '<'))) {
+        return std::string();
+    }
+    std::size_t close = spec.find((spec[0] == '"') ? '"' : '>', 1);
+    if (close == std::string::npos) {
+        return std::string();
+    }
+    fs::path name(spec.substr(1, close - 1));
+
+    std::vector<fs::path> dirs;
+    if (spec[0] == '"') {
+        dirs.push_back(includer.parent_path());
+        dirs.insert(dirs.end(), search.quote_paths.begin(), search.quote_paths.end());
+    }
+    dirs.insert(dirs.end(), search.include_paths.begin(), search.include_paths.end());
+    for (fs::path const & dir : dirs) {
+        boost::system::error_code ec;
+        fs::path candidate = (dir / name).lexically_normal();
+        if (fs::is_regular_file(candidate, ec)) {
+            return candidate.string();
+        }
+    }
+    return std::string();
+}
+
+// bring the index at index_path up to date with the jobs' files
+bool update_region_index(std::vector<compile_job> const & jobs, std::string const & index_path,
+                         index_stats & stats) {
+    region_index old;
+    bool have_old = old.open(index_path);
+
+    region_index_builder builder;
+    std::set<std::string> seen;
+    // files to look at, and the paths that resolve their includes
+    std::vector<std::pair<std::string, std::shared_ptr<include_search const> > > pending;
+    auto visit = [&](std::string const & path, std::shared_ptr<include_search const> const & search) {
+        if (!seen.insert(path).second) {
+            return;
+        }
+        file_version ver = version_of(path);
+        if (ver.size < 0) {
+            return;      // gone
+        }
+        std::string includes;
+        std::uint32_t f = have_old ? old.find_file(path) : 0;
+        if (have_old && (f != old.file_count()) &&
+            (old.file(f).mtime_ns == ver.mtime_ns) && (old.file(f).size == ver.size)) {
+            includes = old.file_includes(f).to_string();
+            builder.add_file(path, ver, old.file_regions(f), includes, search->encode());
+            stats.reused++;
+        } else {
+            mapped_file source;
+            if (!source.open(path.c_str())) {
+                return;
+            }
+            std::vector<std::string> specs;
+            std::vector<scanned_region> regions = scan_regions(source.begin(), source.end(), &specs);
+            for (std::string const & spec : specs) {
+                includes += spec + "\n";
+            }
+            builder.add_file(path, ver, std::move(regions), includes, search->encode());
+            stats.scanned++;
+        }
+        include_search::for_each_line(includes, [&](boost::string_ref spec) {
+            std::string header = resolve_include(spec.to_string(), path, *search);
+            if (!header.empty()) {
+                pending.emplace_back(header, search);
+            }
+        });
+    };
+    auto visit_all = [&]() {
+        while (!pending.empty()) {
+            auto next = pending.back();
+            pending.pop_back();
+            visit(next.first, next.second);
+        }
+    };
+
+    for (compile_job const & job : jobs) {
+        pending.emplace_back(job.file.string(), std::make_shared<include_search const>(include_search::of(job)));
+        visit_all();
+    }
+    // anything indexed before but not reached this time (e.g. from other sources), with the
+    // search paths it was indexed with
+    if (have_old) {
+        for (std::uint32_t f = 0; f < old.file_count(); ++f) {
+            pending.emplace_back(old.file_path(f).to_string(),
+                                 std::make_shared<include_search const>(include_search::decode(old.file_search(f))));
+            visit_all();
+        }
+    }
+    return builder.write(index_path);
+}
+
+// print where each of the named macros is tested, according to the index
+void query_region_index(region_index const & index, std::vector<std::string> const & macros,
+                        std::ostream & out) {
+    for (std::string const & name : macros) {
+        auto uses = index.uses(name);
+        out << name << ": " << (uses.second - uses.first) << " regions\n";
+        for (index_ref const * ref = uses.first; ref != uses.second; ++ref) {
+            index_region const & r = index.region(ref->region);
+            out << "  " << index.file_path(r.file) << ":" << r.begin_line << "-" << r.end_line
+                << ": #" << directive_name(directive_kind(r.kind));
+            if (r.condition_len) {
+                out << " " << index.condition(r);
+            }
+            out << " (" << polarity_name(region_polarity(ref->polarity))
+                << ", depth " << r.depth << ")\n";
+        }
+    }
+}
+
+// Preprocess all jobs using a pool of worker threads
+// Workers claim the next unprocessed job from a shared counter, so long and short
+// files balance out without any up-front partitioning.
+void run_batch(std::vector<compile_job> const & jobs,
+               batch_options const & opts,
+               batch_stats & stats) {
+    using clock = std::chrono::steady_clock;
+    auto ns_since = [](clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+    };
+
+    std::atomic<std::size_t> next_job(0);
+    std::mutex               err_mutex;    // keeps diagnostics from different files apart
+
+    auto worker = [&]() {
+        for (std::size_t i = next_job++; i < jobs.size(); i = next_job++) {
+            std::ostringstream err;
+            bool ok = false;
+
+            if (opts.prefilter) {
+                auto scan_start = clock::now();
+                bool passed_through = pass_through_job(jobs[i], opts, err, ok);
+                stats.prefilter_ns += ns_since(scan_start);
+                if (passed_through) {
+                    stats.skipped++;
+                    if (!ok) {
+                        stats.failures++;
+                        std::lock_guard<std::mutex> lock(err_mutex);
+                        std::cerr << err.str();
+                    }
+                    continue;
+                }
+            }
+
+            if (opts.engine == stage1_engine::directives) {
+                auto scan_start = clock::now();
+                bool scanned = discover_job(jobs[i], opts, err, ok);
+                stats.scan_ns += ns_since(scan_start);
+                if (scanned) {
+                    stats.scanned++;
+                    if (!ok) {
+                        stats.failures++;
+                        std::lock_guard<std::mutex> lock(err_mutex);
+                        std::cerr << err.str();
+                    }
+                    continue;
+                }
+                stats.fallbacks++;
+            }
+
+            auto pp_start = clock::now();
+            switch (opts.input) {
+            case input_policy::cached:
+                ok = preprocess_job<context_type>(jobs[i], opts, err);
+                break;
+            case input_policy::mmap:
+                ok = preprocess_job<mmap_context_type>(jobs[i], opts, err);
+                break;
+            case input_policy::string:
+                ok = preprocess_job<string_context_type>(jobs[i], opts, err);
+                break;
+            }
+            stats.preprocess_ns += ns_since(pp_start);
+            stats.preprocessed++;
+            if (!ok) {
+                stats.failures++;
+            }
+            if (!err.str().empty()) {
+                std::lock_guard<std::mutex> lock(err_mutex);
+                std::cerr << err.str();
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < opts.thread_count; ++t) {
+        pool.emplace_back(worker);
+    }
+    for (std::thread & t : pool) {
+        t.join();
     }
 }
 
-int main() {
+void run_examples() {
     // emulate some interesting preprocessor behavior
 
     // PP events that are "not for us"
@@ -339,3 +1432,212 @@ int main() {
                      "    return i;  // used - but only outside the ifdefs\n" \
                 "}\n" ) ;
 }
+
+int stage1_main(int argc, char const **argv) {
+    namespace po = boost::program_options;
+    namespace fs = boost::filesystem;
+
+    po::options_description desc("Options");
+    desc.add_options()
+        ("help,h", "produce this message")
+        ("build-path,p", po::value<std::string>(),
+         "directory containing compile_commands.json; if absent, run the built-in examples")
+        ("output-dir,o", po::value<std::string>()->default_value("rs1_out"),
+         "preprocessed files are written here, under their original paths")
+        ("jobs,j", po::value<unsigned>()->default_value(std::max(1u, std::thread::hardware_concurrency())),
+         "number of worker threads")
+        ("macro,m", po::value<std::vector<std::string>>()->composing(),
+         "a conditional macro to turn into lambdas (may be repeated; default TEST_PP_CONDITIONAL)")
+        ("macros-from", po::value<std::string>(),
+         "read further macros, one per line, from this file")
+        ("input-policy", po::value<std::string>()->default_value("cached"),
+         "how source files are read: \"cached\" lexes each header once per run and replays it, "
+         "\"mmap\" maps and lexes every file each time, \"string\" copies each one into memory first")
+        ("no-prefilter", "run Wave on every file; by default files that never mention a tracked macro "
+         "in a conditional are copied to the output unchanged")
+        ("engine", po::value<std::string>()->default_value("wave"),
+         "\"wave\" preprocesses each file, writing its rewritten source and hunk records; "
+         "\"directives\" only finds the hunks of each main file, from its directives, "
+         "using Wave only where that isn't enough, and writes just the records")
+        ("index", po::value<std::string>(),
+         "with --build-path, build or update this index of conditional regions instead of "
+         "preprocessing; with --query, the index to consult")
+        ("query", po::value<std::vector<std::string>>()->composing(),
+         "list the conditional regions testing this macro, from the index (may be repeated)")
+        ("trace", po::value<std::string>(),
+         "write a Chrome trace (for chrome://tracing or Perfetto) of the time spent in each file "
+         "and its includes here, and print a summary of the most expensive files")
+        ("stats", "report elapsed time, CPU time and peak memory use at the end of a batch")
+        ("source", po::value<std::vector<std::string>>(),
+         "restrict processing to these files from the database");
+    po::positional_options_description positional;
+    positional.add("source", -1);
+
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+        po::notify(vm);
+    } catch (po::error const& e) {
+        std::cerr << e.what() << "\n" << desc << "\n";
+        return 1;
+    }
+    if (vm.count("help")) {
+        std::cout << "usage: " << argv[0] << " [options] [source...]\n" << desc << "\n";
+        return 0;
+    }
+
+    if (vm.count("query")) {
+        if (!vm.count("index")) {
+            std::cerr << "--query needs --index\n";
+            return 1;
+        }
+        auto start = std::chrono::steady_clock::now();
+        region_index index;
+        if (!index.open(vm["index"].as<std::string>())) {
+            std::cerr << "could not read index " << vm["index"].as<std::string>() << "\n";
+            return 1;
+        }
+        query_region_index(index, vm["query"].as<std::vector<std::string>>(), std::cout);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << "queried " << index.region_count() << " regions in " << index.file_count()
+                  << " files in " << elapsed.count() * 1000 << "ms\n";
+        return 0;
+    }
+
+    if (!vm.count("build-path")) {
+        run_examples();
+        return 0;
+    }
+
+    std::vector<compile_job> jobs;
+    try {
+        jobs = read_compilation_database(fs::path(vm["build-path"].as<std::string>()) / "compile_commands.json");
+    } catch (boost::property_tree::ptree_error const& e) {
+        std::cerr << "could not read compilation database: " << e.what() << "\n";
+        return 1;
+    }
+
+    if (vm.count("source")) {
+        // keep only the requested files
+        std::set<fs::path> wanted;
+        for (std::string const & src : vm["source"].as<std::vector<std::string>>()) {
+            wanted.insert(fs::absolute(src).lexically_normal());
+        }
+        jobs.erase(std::remove_if(jobs.begin(), jobs.end(),
+                                  [&wanted](compile_job const & job) { return !wanted.count(job.file); }),
+                   jobs.end());
+    }
+
+    if (vm.count("index")) {
+        auto start = std::chrono::steady_clock::now();
+        index_stats istats;
+        if (!update_region_index(jobs, vm["index"].as<std::string>(), istats)) {
+            std::cerr << "could not write index " << vm["index"].as<std::string>() << "\n";
+            return 1;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << "indexed " << (istats.scanned + istats.reused) << " files ("
+                  << istats.scanned << " scanned, " << istats.reused << " unchanged) in "
+                  << elapsed.count() << "s\n";
+        return 0;
+    }
+
+    batch_options opts;
+    std::vector<std::string> macro_names;
+    if (vm.count("macro")) {
+        macro_names = vm["macro"].as<std::vector<std::string>>();
+    }
+    if (vm.count("macros-from")) {
+        std::ifstream names(vm["macros-from"].as<std::string>());
+        if (!names) {
+            std::cerr << "could not read macro list " << vm["macros-from"].as<std::string>() << "\n";
+            return 1;
+        }
+        std::string name;
+        while (names >> name) {
+            macro_names.push_back(name);
+        }
+    }
+    if (macro_names.empty()) {
+        macro_names.push_back("TEST_PP_CONDITIONAL");
+    }
+    opts.macros = std::make_shared<macro_set const>(macro_names);
+    opts.out_dir      = vm["output-dir"].as<std::string>();
+    opts.thread_count = std::max(1u, vm["jobs"].as<unsigned>());
+    opts.prefilter    = !vm.count("no-prefilter");
+    std::string const & engine = vm["engine"].as<std::string>();
+    if (engine == "wave") {
+        opts.engine = stage1_engine::wave;
+    } else if (engine == "directives") {
+        opts.engine = stage1_engine::directives;
+    } else {
+        std::cerr << "unknown engine " << engine << "\n";
+        return 1;
+    }
+    std::string const & policy = vm["input-policy"].as<std::string>();
+    if (policy == "cached") {
+        opts.input = input_policy::cached;
+    } else if (policy == "mmap") {
+        opts.input = input_policy::mmap;
+    } else if (policy == "string") {
+        opts.input = input_policy::string;
+    } else {
+        std::cerr << "unknown input policy " << policy << "\n";
+        return 1;
+    }
+
+    std::unique_ptr<trace_log> trace;
+    if (vm.count("trace")) {
+        trace.reset(new trace_log);
+    }
+    opts.trace = trace.get();
+
+    auto start = std::chrono::steady_clock::now();
+    batch_stats stats;
+    run_batch(jobs, opts, stats);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cerr << "preprocessed " << stats.preprocessed << " of " << jobs.size() << " files ("
+              << stats.failures << " failed) in "
+              << elapsed.count() << "s using " << opts.thread_count << " threads\n";
+    if (opts.prefilter) {
+        // estimate what the skipped files would have cost from the ones we did preprocess
+        std::cerr << "prefilter: " << stats.skipped << " files passed through unchanged, scanning took "
+                  << stats.prefilter_ns / 1e9 << "s";
+        if (stats.preprocessed) {
+            double per_file = stats.preprocess_ns / 1e9 / stats.preprocessed;
+            std::cerr << ", saving an estimated " << per_file * stats.skipped << "s of preprocessing ("
+                      << per_file * 1000 << "ms per file)";
+        }
+        std::cerr << "\n";
+    }
+    if (opts.engine == stage1_engine::directives) {
+        std::cerr << "directive engine: " << stats.scanned << " files scanned in "
+                  << stats.scan_ns / 1e9 << "s, " << stats.fallbacks << " needed Wave\n";
+    }
+
+    if (trace) {
+        std::string const & trace_file = vm["trace"].as<std::string>();
+        if (!trace->write_chrome_trace(trace_file)) {
+            std::cerr << "could not write trace " << trace_file << "\n";
+        }
+        trace->write_summary(std::cerr, 20);
+    }
+
+    if (vm.count("stats")) {
+        // for comparing input policies etc. - ru_maxrss is in kilobytes on Linux
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        auto seconds = [](timeval const & tv) { return tv.tv_sec + tv.tv_usec / 1e6; };
+        std::cerr << "input policy " << policy << ": wall " << elapsed.count() << "s"
+                  << ", user " << seconds(usage.ru_utime) << "s"
+                  << ", sys " << seconds(usage.ru_stime) << "s"
+                  << ", peak RSS " << usage.ru_maxrss << " KiB\n";
+        if (opts.input == input_policy::cached) {
+            std::cerr << "include cache: " << include_cache::instance().hits() << " hits, "
+                      << include_cache::instance().misses() << " misses\n";
+        }
+    }
+
+    return stats.failures ? 1 : 0;
+}
@@ -13,66 +13,717 @@
 // sample command line:
 // ./rs2 -p=. -extra-arg='-I/usr/lib/gcc/x86_64-linux-gnu/8/include' -extra-arg='-std=c++11' ../test.cpp --
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <condition_variable>
+#include <deque>
+#include <initializer_list>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <memory>
+#include <numeric>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
 
 #include "clang/AST/AST.h"
+#include "clang/AST/ASTConsumer.h"
+#include "clang/AST/RecursiveASTVisitor.h"
 #include "clang/ASTMatchers/ASTMatchers.h"
 #include "clang/ASTMatchers/ASTMatchFinder.h"
 #include "clang/Basic/SourceManager.h"
 #include "clang/Basic/SourceLocation.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendAction.h"
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/Utils.h"
+#include "clang/Tooling/ArgumentsAdjusters.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Refactoring.h"
 #include "clang/Tooling/Tooling.h"
 #include "clang/Lex/Lexer.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/VirtualFileSystem.h"
+
+#include <signal.h>
+
+#include "stage1.hpp"
 
 static llvm::cl::OptionCategory ToolingSampleCategory("Lambda extractor");
 
+static llvm::cl::opt<unsigned> JobCount("j",
+                                        llvm::cl::desc("Number of worker threads (default: one per core)"),
+                                        llvm::cl::init(0),
+                                        llvm::cl::cat(ToolingSampleCategory));
+
+static llvm::cl::opt<bool> AllDecls("all-decls",
+                                    llvm::cl::desc("Search every declaration for lambdas, including those from "
+                                                   "headers (by default only the main file's are searched)"),
+                                    llvm::cl::cat(ToolingSampleCategory));
+
+static llvm::cl::opt<bool> SkipBodies("skip-bodies",
+                                      llvm::cl::desc("Don't parse function bodies that cannot contain one of "
+                                                     "our lambdas (found by a lexical scan)"),
+                                      llvm::cl::cat(ToolingSampleCategory));
+
+static llvm::cl::opt<bool> SharePCH("pch",
+                                    llvm::cl::desc("Precompile the #include block shared by several sources "
+                                                   "once, and use it for each of them"),
+                                    llvm::cl::cat(ToolingSampleCategory));
+
+static llvm::cl::opt<std::string> CacheDir("cache",
+                                          llvm::cl::desc("Keep each source's results in this directory, and reuse "
+                                                         "them while the source, its headers and its compile "
+                                                         "command are unchanged"),
+                                          llvm::cl::value_desc("dir"),
+                                          llvm::cl::cat(ToolingSampleCategory));
+
+static llvm::cl::opt<bool> ProfileMatchers("profile-matchers",
+                                           llvm::cl::desc("Time each matcher, and the frontend phases, for "
+                                                          "every source; print a table at the end"),
+                                           llvm::cl::cat(ToolingSampleCategory));
+
+static llvm::cl::opt<std::string> ProfileJSON("profile-json",
+                                              llvm::cl::desc("With --profile-matchers, also write the timings "
+                                                             "to this file as JSON"),
+                                              llvm::cl::value_desc("file"),
+                                              llvm::cl::cat(ToolingSampleCategory));
+
+static llvm::cl::opt<std::string> NDJSONPath("ndjson",
+                                             llvm::cl::desc("Write each source's results to this file (\"-\" for "
+                                                            "stdout) as NDJSON records as soon as it is done, "
+                                                            "instead of reporting everything at the end"),
+                                             llvm::cl::value_desc("file"),
+                                             llvm::cl::cat(ToolingSampleCategory));
+
+static llvm::cl::opt<bool> ApplyEdits("apply",
+                                      llvm::cl::desc("Apply the replacements to the files, each file in a "
+                                                     "single pass and a single write"),
+                                      llvm::cl::cat(ToolingSampleCategory));
+
+static llvm::cl::opt<std::string> SourcesFrom("sources-from",
+                                              llvm::cl::desc("Analyze the sources listed in this file, one per "
+                                                             "line, instead of those on the command line"),
+                                              llvm::cl::value_desc("file"),
+                                              llvm::cl::cat(ToolingSampleCategory));
+
+static llvm::cl::opt<std::string> Shard("shard",
+                                        llvm::cl::desc("Analyze only the i-th (from 0) of N shards of the "
+                                                       "sources, balanced by file size or past run time"),
+                                        llvm::cl::value_desc("i/N"),
+                                        llvm::cl::cat(ToolingSampleCategory));
+
+static llvm::cl::opt<std::string> ShardWeights("shard-weights",
+                                               llvm::cl::desc("Balance shards by the run times (\"ms\") in the "
+                                                              "source records of this earlier --ndjson output"),
+                                               llvm::cl::value_desc("file"),
+                                               llvm::cl::cat(ToolingSampleCategory));
+
+static llvm::cl::opt<unsigned> Supervise("supervise",
+                                         llvm::cl::desc("Run this many worker processes, one shard each, "
+                                                        "isolating and retrying sources that crash or hang "
+                                                        "them, and merge their results"),
+                                         llvm::cl::init(0),
+                                         llvm::cl::cat(ToolingSampleCategory));
+
+static llvm::cl::opt<unsigned> TUTimeout("tu-timeout",
+                                         llvm::cl::desc("With --supervise, stop a worker that spends longer than "
+                                                        "this on one source (seconds; 0 for no limit)"),
+                                         llvm::cl::init(600),
+                                         llvm::cl::cat(ToolingSampleCategory));
+
+static llvm::cl::opt<unsigned> TUMemory("tu-memory",
+                                        llvm::cl::desc("With --supervise, limit each worker's memory to this "
+                                                       "many MB (0 for no limit)"),
+                                        llvm::cl::init(0),
+                                        llvm::cl::cat(ToolingSampleCategory));
+
+static llvm::cl::opt<unsigned> Retries("retries",
+                                       llvm::cl::desc("With --supervise, how many times a source that brought "
+                                                      "down a worker is retried alone before it is quarantined"),
+                                       llvm::cl::init(1),
+                                       llvm::cl::cat(ToolingSampleCategory));
+
+static llvm::cl::list<std::string> MatchPaths("match-path",
+                                              llvm::cl::desc("Also search declarations from files under this "
+                                                             "directory, or this file (may be repeated)"),
+                                              llvm::cl::cat(ToolingSampleCategory));
+
+static llvm::cl::list<std::string> Stage1Macros("stage1-macro",
+                                                llvm::cl::desc("Run stage 1 first, in this process, turning the "
+                                                               "conditionals on this macro into lambdas, and analyze "
+                                                               "its output from memory (may be repeated)"),
+                                                llvm::cl::value_desc("name"),
+                                                llvm::cl::cat(ToolingSampleCategory));
+
+static llvm::cl::opt<unsigned> Stage1Jobs("stage1-jobs",
+                                          llvm::cl::desc("With --stage1-macro, the number of threads running "
+                                                         "stage 1 (default: half of -j)"),
+                                          llvm::cl::init(0),
+                                          llvm::cl::cat(ToolingSampleCategory));
+
+// How a lambda body uses one of its captured variables
+enum class CaptureUseKind {
+    Read,           // any use not listed below
+    RefParam,       // passed to a non-const lvalue reference parameter
+    Assignment,     // left hand side of =, +=, -=, &= or |=
+    Increment,      // operand of ++ or --
+    Last = Increment
+};
+
+// names for the kinds of use, in NDJSON records
+llvm::StringRef capture_use_name(CaptureUseKind kind) {
+    switch (kind) {
+    case CaptureUseKind::RefParam:   return "ref_param";
+    case CaptureUseKind::Assignment: return "assignment";
+    case CaptureUseKind::Increment:  return "increment";
+    default:                         return "read";
+    }
+}
+
+bool parse_capture_use_name(llvm::StringRef name, CaptureUseKind & kind) {
+    for (CaptureUseKind k : {CaptureUseKind::Read, CaptureUseKind::RefParam,
+                             CaptureUseKind::Assignment, CaptureUseKind::Increment}) {
+        if (name == capture_use_name(k)) {
+            kind = k;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Strings here and in LambdaRecord belong to the AnalysisResults holding the record
+struct CaptureUse {
+    CaptureUseKind  kind;
+    llvm::StringRef var;     // qualified name of the captured variable
+    llvm::StringRef type;
+};
+
+struct LambdaRecord {
+    llvm::StringRef name;
+    llvm::StringRef body;
+    std::uint32_t   first_use;   // its uses are the next use_count in AnalysisResults::uses
+    std::uint32_t   use_count;
+};
+
+// Classifies every use of a lambda's captured variables in a single walk of its body
+// Operators and calls are visited before their operands, so they claim the references they
+// mutate through; any reference still unclaimed when reached is a plain read.  New kinds of
+// use need only another Visit method here.
+// Separately, and conservatively, it works out which captures are only ever read: those
+// whose every reference has its value loaded, is bound to a const reference parameter, or
+// calls a const member function.  Anything else (an operator or call not listed above, taking
+// the address, binding a non-const reference) may change the variable.
+class CaptureUseVisitor : public clang::RecursiveASTVisitor<CaptureUseVisitor> {
+public:
+    explicit CaptureUseVisitor(clang::LambdaExpr const * lambda) {
+        for (clang::LambdaCapture const & lc : lambda->captures()) {
+            if (lc.capturesVariable()) {
+                index_[lc.getCapturedVar()] = captures_.size();
+                captures_.push_back(lc.getCapturedVar());
+            }
+        }
+        uses_.resize(captures_.size());
+    }
+
+    // Call f(var, kind) for the uses found, grouped by capture (in capture order) and then
+    // in the order they appear
+    template <typename F>
+    void for_each_use(F f) const {
+        for (std::size_t i = 0; i < captures_.size(); ++i) {
+            for (CaptureUseKind kind : uses_[i]) {
+                f(captures_[i], kind);
+            }
+        }
+    }
+
+    // whether every reference to var reads it
+    bool only_read(clang::VarDecl const * var) const {
+        return !maybe_changed_.count(var);
+    }
+
+    bool VisitImplicitCastExpr(clang::ImplicitCastExpr * cast) {
+        if (cast->getCastKind() == clang::CK_LValueToRValue) {
+            mark_read(cast->getSubExpr());
+        }
+        return true;
+    }
+
+    bool VisitMemberExpr(clang::MemberExpr * member) {
+        auto method = llvm::dyn_cast<clang::CXXMethodDecl>(member->getMemberDecl());
+        if (method && (method->isConst() || method->isStatic())) {
+            mark_read(member->getBase());
+        }
+        return true;
+    }
+
+    bool VisitCXXConstructExpr(clang::CXXConstructExpr * construct) {
+        mark_const_ref_args(construct->getConstructor(), construct->getArgs(), construct->getNumArgs());
+        return true;
+    }
+
+    bool VisitCallExpr(clang::CallExpr * call) {
+        clang::FunctionDecl const * callee = call->getDirectCallee();
+        if (!callee) {
+            return true;
+        }
+        // a member operator's object comes first among the call's arguments, ahead of those
+        // for its parameters
+        unsigned first = 0;
+        auto method = llvm::dyn_cast<clang::CXXMethodDecl>(callee);
+        if (method && !method->isStatic() && llvm::isa<clang::CXXOperatorCallExpr>(call) &&
+            (call->getNumArgs() > 0)) {
+            first = 1;
+            if (method->isConst()) {
+                mark_read(call->getArg(0));
+            }
+        }
+        mark_const_ref_args(callee, call->getArgs() + first, call->getNumArgs() - first);
+        // as the hasArgParameter matcher did: a capture counts once per call, at the first
+        // argument where it binds to a non-const lvalue reference
+        llvm::SmallPtrSet<clang::VarDecl const *, 4> counted;
+        for (unsigned argno = first;
+             (argno < call->getNumArgs()) && (argno - first < callee->getNumParams());
+             ++argno) {
+            auto ref = llvm::dyn_cast<clang::LValueReferenceType>(
+                callee->getParamDecl(argno - first)->getType().getTypePtr());
+            if (!ref || ref->getPointeeType().isConstQualified()) {
+                continue;
+            }
+            clang::VarDecl const * var = claim(call->getArg(argno));
+            if (var && counted.insert(var).second) {
+                uses_[index_[var]].push_back(CaptureUseKind::RefParam);
+            }
+        }
+        return true;
+    }
+
+    bool VisitBinaryOperator(clang::BinaryOperator * op) {
+        switch (op->getOpcode()) {
+        case clang::BO_Assign:
+        case clang::BO_AddAssign:
+        case clang::BO_SubAssign:
+        case clang::BO_AndAssign:
+        case clang::BO_OrAssign:
+            record(claim(op->getLHS()), CaptureUseKind::Assignment);
+            break;
+        default:
+            break;
+        }
+        return true;
+    }
+
+    bool VisitUnaryOperator(clang::UnaryOperator * op) {
+        if (op->isIncrementDecrementOp()) {
+            record(claim(op->getSubExpr()), CaptureUseKind::Increment);
+        }
+        return true;
+    }
+
+    bool VisitDeclRefExpr(clang::DeclRefExpr * ref) {
+        if (!claimed_.erase(ref)) {
+            record(captured_var(ref), CaptureUseKind::Read);
+        }
+        clang::VarDecl const * var = captured_var(ref);
+        if (var && !read_refs_.erase(ref)) {
+            maybe_changed_.insert(var);
+        }
+        return true;
+    }
+
+private:
+    // a reference to a capture, possibly parenthesized or qualified, only has its value read
+    void mark_read(clang::Expr const * e) {
+        clang::Expr const * ref = e->IgnoreParens();
+        while (auto cast = llvm::dyn_cast<clang::ImplicitCastExpr>(ref)) {
+            if (cast->getCastKind() != clang::CK_NoOp) {
+                break;
+            }
+            ref = cast->getSubExpr()->IgnoreParens();
+        }
+        if (captured_var(ref)) {
+            read_refs_.insert(ref);
+        }
+    }
+
+    // arguments bound to const lvalue reference parameters are read
+    void mark_const_ref_args(clang::FunctionDecl const * callee, clang::Expr const * const * args, unsigned count) {
+        if (!callee) {
+            return;
+        }
+        for (unsigned argno = 0; (argno < count) && (argno < callee->getNumParams()); ++argno) {
+            auto ref = llvm::dyn_cast<clang::LValueReferenceType>(
+                callee->getParamDecl(argno)->getType().getCanonicalType().getTypePtr());
+            if (ref && ref->getPointeeType().isConstQualified() && !ref->getPointeeType().isVolatileQualified()) {
+                mark_read(args[argno]);
+            }
+        }
+    }
+
+    clang::VarDecl const * captured_var(clang::Expr const * e) const {
+        auto ref = llvm::dyn_cast<clang::DeclRefExpr>(e);
+        if (!ref) {
+            return nullptr;
+        }
+        auto var = llvm::dyn_cast<clang::VarDecl>(ref->getDecl());
+        return (var && index_.count(var)) ? var : nullptr;
+    }
+
+    // a reference to a capture, used directly as the operand e, is accounted for
+    clang::VarDecl const * claim(clang::Expr const * e) {
+        clang::VarDecl const * var = captured_var(e);
+        if (var) {
+            claimed_.insert(e);
+        }
+        return var;
+    }
+
+    void record(clang::VarDecl const * var, CaptureUseKind kind) {
+        if (var) {
+            uses_[index_[var]].push_back(kind);
+        }
+    }
+
+    std::vector<clang::VarDecl const *>                 captures_;
+    llvm::DenseMap<clang::VarDecl const *, std::size_t> index_;
+    std::vector<std::vector<CaptureUseKind> >           uses_;      // by capture
+    llvm::SmallPtrSet<clang::Expr const *, 16>          claimed_;   // not yet visited
+    llvm::SmallPtrSet<clang::Expr const *, 16>          read_refs_; // only read; not yet visited
+    llvm::SmallPtrSet<clang::VarDecl const *, 8>        maybe_changed_;
+};
+
+// Everything the callbacks collect from one translation unit
+// Records are kept in the order they were found, in contiguous vectors, and their strings in
+// an arena belonging to the results: names and types are interned, as one capture has many
+// uses, and lambda bodies copied in once.  Nothing is turned into a std::string until the
+// report.
+struct AnalysisResults {
+    typedef std::map<std::string, clang::tooling::Replacements> replacement_map;
+
+    std::vector<LambdaRecord>   lambdas;
+    std::vector<CaptureUse>     uses;
+    replacement_map             replacements;
+
+    llvm::ArrayRef<CaptureUse> uses_of(LambdaRecord const & lambda) const {
+        return llvm::ArrayRef<CaptureUse>(uses).slice(lambda.first_use, lambda.use_count);
+    }
+
+    // a copy of s in the arena, shared with any equal string interned before
+    llvm::StringRef intern(llvm::StringRef s) { return strings().names.save(s); }
+    // a copy of s in the arena
+    llvm::StringRef save(llvm::StringRef s) { return strings().text.save(s); }
+
+private:
+    // kept apart so the strings stay put when the results are moved, and made only when
+    // needed, so empty results cost nothing
+    struct Strings {
+        llvm::BumpPtrAllocator   arena;
+        llvm::StringSaver        text{arena};
+        llvm::UniqueStringSaver  names{arena};
+    };
+    Strings & strings() {
+        if (!strings_) {
+            strings_ = std::make_unique<Strings>();
+        }
+        return *strings_;
+    }
+
+    std::unique_ptr<Strings> strings_;
+};
+
+// Finds, in one walk of a function body, each local variable's references and the calls
+// made through it ("f()"), so the calls to any number of lambdas there can be rewritten
+class LocalCallVisitor : public clang::RecursiveASTVisitor<LocalCallVisitor> {
+public:
+    struct Uses {
+        unsigned                                                  refs = 0;
+        llvm::SmallVector<clang::CXXOperatorCallExpr const *, 1>  calls;
+    };
+    typedef llvm::DenseMap<clang::VarDecl const *, Uses> use_map;
+
+    explicit LocalCallVisitor(use_map & uses) : uses_(uses) {}
+
+    bool VisitCXXOperatorCallExpr(clang::CXXOperatorCallExpr * call) {
+        if ((call->getOperator() == clang::OO_Call) && (call->getNumArgs() > 0)) {
+            if (auto ref = llvm::dyn_cast<clang::DeclRefExpr>(call->getArg(0)->IgnoreImplicit())) {
+                if (auto var = llvm::dyn_cast<clang::VarDecl>(ref->getDecl())) {
+                    uses_[var].calls.push_back(call);
+                }
+            }
+        }
+        return true;
+    }
+
+    bool VisitDeclRefExpr(clang::DeclRefExpr * ref) {
+        if (auto var = llvm::dyn_cast<clang::VarDecl>(ref->getDecl())) {
+            uses_[var].refs++;
+        }
+        return true;
+    }
+
+private:
+    use_map & uses_;
+};
+
 class LambdaHandler : public clang::ast_matchers::MatchFinder::MatchCallback {
-    using replacement_map = std::map<std::string, clang::tooling::Replacements>;
 public:
-    LambdaHandler(replacement_map const * replace) : replace_(replace) {}
+    explicit LambdaHandler(AnalysisResults & results) : results_(results) {}
+
+    // names the matcher in profiles
+    virtual llvm::StringRef getID() const override { return "expression_capture lambda"; }
 
     virtual void run(clang::ast_matchers::MatchFinder::MatchResult const& result) override {
         using namespace clang;
         if (LambdaExpr const * lambda = result.Nodes.getNodeAs<LambdaExpr>("lambda")) {
             VarDecl    const * lambda_var = result.Nodes.getNodeAs<VarDecl>("lambdavar");
+            llvm::SmallString<64> name;
+            llvm::raw_svector_ostream name_os(name);
+            lambda_var->printQualifiedName(name_os);
             // display lambda contents
             auto body      = lambda->getBody();
             auto bodyStart = body->getBeginLoc().getLocWithOffset(1);   // skip left brace
             auto bodyEnd   = body->getEndLoc().getLocWithOffset(-1);    // drop right brace
             auto bodyRange = CharSourceRange::getTokenRange(bodyStart, bodyEnd);
-            lambda_bodies[lambda_var->getQualifiedNameAsString()] =
-                Lexer::getSourceText(bodyRange,
-                                     *result.SourceManager,
-                                     result.Context->getLangOpts()).str();
+            LambdaRecord record{results_.intern(name),
+                                results_.save(Lexer::getSourceText(bodyRange,
+                                                                   *result.SourceManager,
+                                                                   result.Context->getLangOpts())),
+                                static_cast<std::uint32_t>(results_.uses.size()), 0};
+
+            // and how it uses its captures
+            CaptureUseVisitor visitor(lambda);
+            visitor.TraverseStmt(body);
+            visitor.for_each_use([&](VarDecl const * var, CaptureUseKind kind) {
+                std::pair<llvm::StringRef, llvm::StringRef> const & desc = describe(var);
+                results_.uses.push_back(CaptureUse{kind, desc.first, desc.second});
+            });
+            record.use_count = static_cast<std::uint32_t>(results_.uses.size() - record.first_use);
+            results_.lambdas.push_back(record);
+
+            rewrite(result, lambda, lambda_var, visitor);
         }
     }
-    std::map<std::string, std::string> lambda_bodies;
 private:
-    replacement_map const * replace_;
-};
+    // Make the lambda a function of the variables it captured, taking those it provably only
+    // reads by const reference and the rest by reference, and pass them at each call.
+    // Lambdas used other than by calling them, or whose text comes from macros, are left
+    // alone, as are those with state of their own: mutable lambdas, init-captures, and
+    // captures by copy (which hold the value from when the lambda was made, not called).
+    // So are lambdas in templates, where the types of the captures are not those written,
+    // and those capturing a variable whose type cannot be written (see spellable).
+    void rewrite(clang::ast_matchers::MatchFinder::MatchResult const & result,
+                 clang::LambdaExpr const * lambda, clang::VarDecl const * lambda_var,
+                 CaptureUseVisitor const & visitor) {
+        using namespace clang;
+        SourceManager const & sm = *result.SourceManager;
+        LangOptions const & lang_opts = result.Context->getLangOpts();
 
-class CaptureHandler : public clang::ast_matchers::MatchFinder::MatchCallback {
-    using replacement_map = std::map<std::string, clang::tooling::Replacements>;
-public:
-    typedef std::map<std::string,
-                     std::vector<std::pair<std::string, std::string> > > capture_map_t;
-    CaptureHandler(replacement_map const * replace,
-                   capture_map_t & captured_vars) : replace_(replace), captured_vars_(captured_vars) {}
+        if (lambda->isMutable()) {
+            return;
+        }
+        auto function = llvm::dyn_cast_or_null<FunctionDecl>(lambda_var->getParentFunctionOrMethod());
+        if (!function || !function->getBody() || in_template(function)) {
+            return;
+        }
+        auto found = local_uses_.find(function);
+        if (found == local_uses_.end()) {
+            found = local_uses_.try_emplace(function).first;
+            LocalCallVisitor(found->second).TraverseStmt(function->getBody());
+        }
+        auto uses = found->second.find(lambda_var);
+        if ((uses == found->second.end()) || (uses->second.refs != uses->second.calls.size())) {
+            return;
+        }
 
-    virtual void run(clang::ast_matchers::MatchFinder::MatchResult const& result) override {
+        // the new parameters, and the arguments for them
+        std::string params, args;
+        llvm::raw_string_ostream params_os(params), args_os(args);
+        bool captures_this = false;
+        for (LambdaCapture const & lc : lambda->captures()) {
+            if (lc.capturesThis() && (lc.getCaptureKind() == LCK_This)) {
+                captures_this = true;
+                continue;
+            }
+            if (!lc.capturesVariable() || (lc.getCaptureKind() != LCK_ByRef)) {
+                return;
+            }
+            VarDecl const * var = lc.getCapturedVar();
+            if (var->isInitCapture() || !spellable(var->getType())) {
+                return;
+            }
+            QualType type = var->getType().getNonReferenceType();
+            if (visitor.only_read(var)) {
+                type = type.withConst();
+            }
+            if (!args_os.str().empty()) {
+                params_os << ", ";
+                args_os << ", ";
+            }
+            PrintingPolicy policy = result.Context->getPrintingPolicy();
+            policy.SuppressUnwrittenScope = true;     // no "(anonymous namespace)::"
+            result.Context->getLValueReferenceType(type).print(params_os, policy, var->getName());
+            args_os << var->getName();
+        }
+
+        // the introducer, and the (empty) parameter list if there is one
+        SourceLocation intro_begin = lambda->getIntroducerRange().getBegin();
+        SourceLocation intro_end = lambda->getIntroducerRange().getEnd();
+        if (lambda->hasExplicitParameters()) {
+            auto proto = lambda->getCallOperator()->getTypeSourceInfo()->getTypeLoc()
+                .getAsAdjusted<FunctionProtoTypeLoc>();
+            if (!proto || (proto.getNumParams() != 0)) {
+                return;
+            }
+            intro_end = proto.getRParenLoc();
+        }
+        if (intro_begin.isMacroID() || intro_end.isMacroID()) {
+            return;
+        }
+        std::vector<tooling::Replacement> edits;
+        edits.emplace_back(sm, CharSourceRange::getTokenRange(intro_begin, intro_end),
+                           std::string(captures_this ? "[this](" : "[](") + params_os.str() + ")",
+                           lang_opts);
+        for (CXXOperatorCallExpr const * call : uses->second.calls) {
+            SourceLocation callee_end = Lexer::getLocForEndOfToken(call->getArg(0)->getEndLoc(), 0, sm, lang_opts);
+            SourceLocation rparen = call->getRParenLoc();
+            if (callee_end.isInvalid() || rparen.isMacroID()) {
+                return;
+            }
+            edits.emplace_back(sm, CharSourceRange::getCharRange(callee_end, rparen.getLocWithOffset(1)),
+                               "(" + args_os.str() + ")", lang_opts);
+        }
+
+        for (tooling::Replacement const & edit : edits) {
+            if (edit.getFilePath().empty()) {
+                return;
+            }
+        }
+        // all of the edits or none: the lambda with only some of them would not compile
+        AnalysisResults::replacement_map updated;
+        for (tooling::Replacement const & edit : edits) {
+            // by absolute path, as the tool's working directory is the compile directory
+            llvm::SmallString<256> path(edit.getFilePath());
+            sm.getFileManager().getVirtualFileSystem().makeAbsolute(path);
+            llvm::sys::path::remove_dots(path, true);
+            tooling::Replacement absolute(path, edit.getOffset(), edit.getLength(), edit.getReplacementText());
+            auto file = updated.find(path.str().str());
+            if (file == updated.end()) {
+                auto existing = results_.replacements.find(path.str().str());
+                file = updated.emplace(path.str().str(), (existing == results_.replacements.end())
+                                                         ? tooling::Replacements() : existing->second).first;
+            }
+            if (llvm::Error err = file->second.add(absolute)) {
+                llvm::errs() << "not rewriting " << lambda_var->getName() << ": " << absolute.toString()
+                             << " conflicts: " << llvm::toString(std::move(err)) << "\n";
+                return;
+            }
+        }
+        for (auto & file : updated) {
+            results_.replacements[file.first] = std::move(file.second);
+        }
+    }
+
+    // whether dc is in a template, or an instantiation of one, whether of a function or class
+    static bool in_template(clang::DeclContext const * dc) {
+        if (dc->isDependentContext()) {
+            return true;
+        }
+        for (; dc; dc = dc->getParent()) {
+            if (auto function = llvm::dyn_cast<clang::FunctionDecl>(dc)) {
+                if (function->isTemplateInstantiation()) {
+                    return true;
+                }
+            } else if (auto record = llvm::dyn_cast<clang::CXXRecordDecl>(dc)) {
+                if (record->getTemplateSpecializationKind() != clang::TSK_Undeclared) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // whether a parameter of this type can be written as QualType::print writes it: not a
+    // closure type, an unnamed type, or a type local to a function, and not built from one
+    static bool spellable(clang::QualType type) {
         using namespace clang;
-        if (VarDecl const * capture = result.Nodes.getNodeAs<VarDecl>("capture")) {
-            VarDecl const * lambda_var = result.Nodes.getNodeAs<VarDecl>("lambdavar");
-            captured_vars_[lambda_var->getQualifiedNameAsString()].emplace_back(capture->getQualifiedNameAsString(),
-                                                                               capture->getType().getAsString());
+        Type const * t = type.getCanonicalType().getTypePtr();
+        if (auto pointer = llvm::dyn_cast<PointerType>(t)) {
+            return spellable(pointer->getPointeeType());
+        }
+        if (auto ref = llvm::dyn_cast<ReferenceType>(t)) {
+            return spellable(ref->getPointeeType());
+        }
+        if (auto member = llvm::dyn_cast<MemberPointerType>(t)) {
+            return spellable(member->getPointeeType()) && spellable(QualType(member->getClass(), 0));
         }
+        if (auto array = llvm::dyn_cast<ArrayType>(t)) {
+            return spellable(array->getElementType());
+        }
+        if (auto function = llvm::dyn_cast<FunctionProtoType>(t)) {
+            for (QualType param : function->getParamTypes()) {
+                if (!spellable(param)) {
+                    return false;
+                }
+            }
+            return spellable(function->getReturnType());
+        }
+        TagDecl const * tag = t->getAsTagDecl();
+        if (!tag) {
+            return true;
+        }
+        if (!tag->getIdentifier() && !tag->getTypedefNameForAnonDecl()) {
+            return false;
+        }
+        if (tag->getParentFunctionOrMethod()) {
+            return false;       // local, closure types included
+        }
+        if (auto spec = llvm::dyn_cast<ClassTemplateSpecializationDecl>(tag)) {
+            for (TemplateArgument const & arg : spec->getTemplateArgs().asArray()) {
+                if ((arg.getKind() == TemplateArgument::Type) && !spellable(arg.getAsType())) {
+                    return false;
+                }
+            }
+        }
+        return true;
     }
-private:
-    replacement_map const * replace_;
-    capture_map_t & captured_vars_;
+
+    // the (interned) qualified name and type of a captured variable, worked out once
+    std::pair<llvm::StringRef, llvm::StringRef> const & describe(clang::VarDecl const * var) {
+        auto it = captures_.find(var);
+        if (it == captures_.end()) {
+            llvm::SmallString<64> name, type;
+            llvm::raw_svector_ostream name_os(name), type_os(type);
+            var->printQualifiedName(name_os);
+            // as QualType::getAsString prints it
+            var->getType().print(type_os, clang::PrintingPolicy(clang::LangOptions()));
+            it = captures_.try_emplace(var, results_.intern(name), results_.intern(type)).first;
+        }
+        return it->second;
+    }
+
+    AnalysisResults & results_;
+    llvm::DenseMap<clang::VarDecl const *, std::pair<llvm::StringRef, llvm::StringRef> > captures_;
+    llvm::DenseMap<clang::FunctionDecl const *, LocalCallVisitor::use_map>                local_uses_;
 };
 
 // a matcher for our special lambdas with binders to help us extract body code
@@ -88,154 +739,1815 @@ clang::ast_matchers::DeclarationMatcher make_lambda_matcher(M const& child_match
                    decl().bind("lambdavar"));
 }
 
-namespace custom_matchers {
-// Clang does not currently provide a Traversal matcher to go from lambda expressions to
-// associated capture variables, so let's make one.  Following the forEachSwitchCase pattern:
-AST_MATCHER_P(clang::LambdaExpr, forEachCaptureVar,
-              clang::ast_matchers::internal::Matcher<clang::VarDecl>, InnerMatcher) {
-    using namespace clang::ast_matchers::internal;
-    BoundNodesTreeBuilder Result;
-    bool Matched = false;
-    for (clang::LambdaCapture const & lc : Node.captures()) {
-        if (!lc.capturesVariable()) {
-            continue;
+// Which top-level declarations of a translation unit the matchers see
+// Our lambdas are only ever in user code, so there is no point matching through the
+// (much larger) declarations of the system and library headers.
+struct MatchScope {
+    bool                      all_decls = false;
+    std::vector<std::string>  paths;        // absolute; in addition to the main file
+    bool                      skip_bodies = false;    // parse only bodies that mention a lambda
+
+    bool includes_file(clang::SourceManager const & sm, clang::FileID fid) const {
+        if (fid == sm.getMainFileID()) {
+            return true;
+        }
+        clang::FileEntry const * entry = sm.getFileEntryForID(fid);
+        if (!entry || paths.empty()) {
+            return false;
         }
-        BoundNodesTreeBuilder LambdaBuilder(*Builder);
-        bool CaptureMatched = InnerMatcher.matches(*lc.getCapturedVar(), Finder, &LambdaBuilder);
-        if (CaptureMatched) {
-            Matched = true;
-            Result.addMatch(LambdaBuilder);
+        llvm::StringRef name = entry->tryGetRealPathName();
+        if (name.empty()) {
+            name = entry->getName();
+        }
+        for (std::string const & path : paths) {
+            // the path itself, or something in the directory it names
+            if (name.startswith(path) &&
+                ((name.size() == path.size()) || (name[path.size()] == '/') || (path.back() == '/'))) {
+                return true;
+            }
         }
+        return false;
     }
-    *Builder = std::move(Result);
-    return Matched;
-}
+};
 
-// Clang has no matcher for simultaneously matching a caller's argument with the callee parameter
-// This one will return true, with associated matches, on the first argument/parameter pair it finds
-// that pass the supplied inner matchers
-AST_MATCHER_P2(clang::CallExpr, hasArgParameter,
-               clang::ast_matchers::internal::Matcher<clang::Expr>, ArgMatcher,
-               clang::ast_matchers::internal::Matcher<clang::ParmVarDecl>, ParamMatcher) {
-    using namespace clang::ast_matchers::internal;
+// Decides, without parsing it, whether a function body might declare one of our lambdas
+// The files holding function definitions are searched once for the lambda variable names.
+// If a file has any, the text of each body is raw lexed (tracking only brackets, to find
+// where it ends) to see whether one of them falls within it.
+class MarkerPrescan {
+public:
+    MarkerPrescan(clang::SourceManager const & sm, clang::LangOptions const & lang_opts)
+        : sm_(sm), lang_opts_(lang_opts) {}
 
-    auto callee = Node.getDirectCallee();
+    bool may_contain_marker(clang::Decl const * d) {
+        clang::SourceLocation loc = sm_.getExpansionLoc(d->getLocation());
+        if (loc.isInvalid()) {
+            return true;
+        }
+        std::pair<clang::FileID, unsigned> pos = sm_.getDecomposedLoc(loc);
+        std::vector<unsigned> const & markers = file_markers(pos.first);
+        auto first = std::lower_bound(markers.begin(), markers.end(), pos.second);
+        if (first == markers.end()) {
+            return false;
+        }
+        return *first < definition_end(pos.first, pos.second);
+    }
 
-    for (unsigned argno = 0;
-         (argno < Node.getNumArgs()) && (argno < callee->getNumParams());
-         ++argno) {
-        BoundNodesTreeBuilder Result(*Builder);
+private:
+    // the fixed part of the names make_lambda_matcher looks for
+    static llvm::StringRef marker_prefix() { return "expression_capture_"; }
 
-        auto arg   = Node.getArg(argno);
-        bool ArgMatched = ArgMatcher.matches(*arg, Finder, &Result);
+    static bool is_marker(llvm::StringRef ident) {
+        std::size_t at = ident.find(marker_prefix());
+        return (at != llvm::StringRef::npos) && (at + marker_prefix().size() < ident.size()) &&
+            std::isdigit(static_cast<unsigned char>(ident[at + marker_prefix().size()]));
+    }
 
-        auto param = callee->getParamDecl(argno);
-        bool ParamMatched = ParamMatcher.matches(*param, Finder, &Result);
+    // offsets of the identifiers that look like our lambda variable names, in order
+    std::vector<unsigned> const & file_markers(clang::FileID fid) {
+        auto it = markers_.find(fid);
+        if (it != markers_.end()) {
+            return it->second;
+        }
+        std::vector<unsigned> & markers = markers_[fid];
+        llvm::StringRef text = sm_.getBufferData(fid);
+        if (text.find(marker_prefix()) == llvm::StringRef::npos) {
+            return markers;           // the usual case, and no lexing required
+        }
+        clang::Lexer lexer(sm_.getLocForStartOfFile(fid), lang_opts_,
+                           text.begin(), text.begin(), text.end());
+        clang::Token tok;
+        while (!lexer.LexFromRawLexer(tok)) {
+            if (tok.is(clang::tok::raw_identifier) && is_marker(tok.getRawIdentifier())) {
+                markers.push_back(sm_.getFileOffset(tok.getLocation()));
+            }
+        }
+        return markers;
+    }
 
-        if (ArgMatched && ParamMatched) {
-            *Builder = std::move(Result);
-            return true;
+    // The end of the function definition whose name is at offset: the close of the first
+    // brace block outside parentheses, unless what follows shows it was part of the
+    // declarator or a constructor initializer (, { > . -> catch)
+    unsigned definition_end(clang::FileID fid, unsigned offset) const {
+        llvm::StringRef text = sm_.getBufferData(fid);
+        clang::Lexer lexer(sm_.getLocForStartOfFile(fid), lang_opts_,
+                           text.begin(), text.begin() + offset, text.end());
+        clang::Token tok;
+        int parens = 0;
+        int braces = 0;
+        bool closed = false;        // a block at the outer level just ended
+        unsigned end = text.size();
+        while (!lexer.LexFromRawLexer(tok)) {
+            while (tok.is(clang::tok::hash) && tok.isAtStartOfLine()) {
+                // a directive; its brackets don't count
+                while (!lexer.LexFromRawLexer(tok) && !tok.isAtStartOfLine()) {}
+            }
+            if (tok.is(clang::tok::eof)) {
+                break;
+            }
+            if (closed) {
+                bool continues = tok.isOneOf(clang::tok::comma, clang::tok::l_brace, clang::tok::greater,
+                                             clang::tok::period, clang::tok::arrow) ||
+                    (tok.is(clang::tok::raw_identifier) && (tok.getRawIdentifier() == "catch"));
+                if (!continues) {
+                    return end;
+                }
+                closed = false;
+            }
+            switch (tok.getKind()) {
+            case clang::tok::l_paren:
+                ++parens;
+                break;
+            case clang::tok::r_paren:
+                --parens;
+                break;
+            case clang::tok::l_brace:
+                ++braces;
+                break;
+            case clang::tok::r_brace:
+                if ((--braces == 0) && (parens == 0)) {
+                    closed = true;
+                    end = sm_.getFileOffset(tok.getLocation()) + 1;
+                }
+                break;
+            case clang::tok::semi:
+                if ((braces == 0) && (parens == 0)) {
+                    return sm_.getFileOffset(tok.getLocation());     // not a definition after all
+                }
+                break;
+            default:
+                break;
+            }
         }
+        return end;
     }
-    return false;
-}
 
-}
+    clang::SourceManager const &                  sm_;
+    clang::LangOptions const &                    lang_opts_;
+    std::map<clang::FileID, std::vector<unsigned> > markers_;
+};
 
-int main(int argc, char const **argv) {
-    using namespace clang;
-    using namespace clang::tooling;
-    using namespace clang::ast_matchers;
+// Where the frontend's time goes for one source, when profiling
+// Clang's parser calls Sema as it goes, so the two can only be timed together.
+struct PhaseTimes {
+    std::int64_t frontend_ns = 0;      // parse, sema and match
+    std::int64_t match_ns = 0;
 
-    auto opt = CommonOptionsParser::create(argc, argv, ToolingSampleCategory);
-    RefactoringTool     tool(opt->getCompilations(), opt->getSourcePathList());
-
-    MatchFinder  finder;
-
-    // set up callbacks
-    LambdaHandler       lambda_handler(&tool.getReplacements());
-
-    // lambda bodies
-    auto lambda_matcher = make_lambda_matcher(anything());
-    finder.addMatcher(lambda_matcher, &lambda_handler);
-
-    // usage of captured variables
-    using custom_matchers::forEachCaptureVar;
-    using custom_matchers::hasArgParameter;
-    // lambda captures used as non-const reference parameters in called functions
-    auto refparm_capture_matcher =
-        make_lambda_matcher(lambdaExpr(
-                                // remember captures
-                                forEachCaptureVar(decl().bind("capture")),
-                                forEachDescendant(
-                                    // look for calls within the lambda body
-                                    callExpr(
-                                        hasArgParameter(
-                                            // with some argument that is a captured variable
-                                            declRefExpr(to(equalsBoundNode("capture"))),
-                                            // bound to a non-const ref parameter
-                                            parmVarDecl(hasType(lValueReferenceType(
-                                                                    unless(pointee(isConstQualified()))))))))));
-
-    CaptureHandler::capture_map_t captured_ref_params;
-    CaptureHandler      refparm_capture_handler(&tool.getReplacements(), captured_ref_params);
-    finder.addMatcher(refparm_capture_matcher, &refparm_capture_handler);
-
-    // lambda captures used as LHS of assignments or mutating operators
-    auto assignment_capture_matcher =
-        make_lambda_matcher(lambdaExpr(
-                                // remember captures
-                                forEachCaptureVar(decl().bind("capture")),
-                                forEachDescendant(
-                                    stmt(anyOf(
-                                             // mutating binary operators
-                                             binaryOperator(
-                                                 // that use one of our captures
-                                                 hasLHS(declRefExpr(to(equalsBoundNode("capture")))),
-                                                 anyOf(hasOperatorName("="),
-                                                       hasOperatorName("+="),
-                                                       hasOperatorName("-="),
-                                                       hasOperatorName("&="),
-                                                       hasOperatorName("|="))),
-                                             // mutating unary operators
-                                             unaryOperator(
-                                                 hasUnaryOperand(declRefExpr(to(equalsBoundNode("capture")))),
-                                                 anyOf(hasOperatorName("++"),
-                                                       hasOperatorName("--"))))))));
-                                                   
-    CaptureHandler::capture_map_t captured_assignments;
-    CaptureHandler      assignment_capture_handler(&tool.getReplacements(), captured_assignments);
-    finder.addMatcher(assignment_capture_matcher, &assignment_capture_handler);
-
-    if (int result = tool.run(newFrontendActionFactory(&finder).get())) {
-        return result;
+    static std::int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
     }
+};
 
-    // report accumulated data
-    for (auto lb : lambda_handler.lambda_bodies) {
-        std::cout << "lambda " << lb.first << " has body:\n" << lb.second << "\n";
-        if (captured_ref_params.find(lb.first) != captured_ref_params.end()) {
-            std::cout << "    and lvalue ref captures:\n";
-            for (auto capture : captured_ref_params[lb.first]) {
-                std::cout << "\t" << capture.first << " of type " << capture.second << "\n";
+// Restricts the AST traversal to the declarations in scope, then runs the matchers
+class ScopedMatchConsumer : public clang::ASTConsumer {
+public:
+    // prescan: if non-null, bodies are parsed only when it says they might hold a lambda
+    // times: if non-null, receives the time spent matching
+    ScopedMatchConsumer(clang::ast_matchers::MatchFinder & finder, MatchScope const & scope,
+                        std::unique_ptr<MarkerPrescan> prescan, PhaseTimes * times)
+        : finder_(finder), scope_(scope), prescan_(std::move(prescan)), times_(times) {}
+
+    // asked by Sema, when skipping function bodies is enabled, at each body it could skip
+    virtual bool shouldSkipFunctionBody(clang::Decl * d) override {
+        return prescan_ && !prescan_->may_contain_marker(d);
+    }
+
+    virtual void HandleTranslationUnit(clang::ASTContext & context) override {
+        std::int64_t start = times_ ? PhaseTimes::now_ns() : 0;
+        if (!scope_.all_decls) {
+            clang::SourceManager const & sm = context.getSourceManager();
+            std::map<clang::FileID, bool> in_scope;     // most files hold many declarations
+            std::vector<clang::Decl *> decls;
+            // The main file's declarations are never in a PCH, so unless other files are
+            // wanted too there is no need to deserialize a PCH's declarations to check them
+            clang::TranslationUnitDecl * tu = context.getTranslationUnitDecl();
+            auto tu_decls = scope_.paths.empty() ? tu->noload_decls() : tu->decls();
+            for (clang::Decl * d : tu_decls) {
+                clang::SourceLocation loc = sm.getExpansionLoc(d->getLocation());
+                if (loc.isInvalid()) {
+                    continue;                           // builtin or implicit
+                }
+                clang::FileID fid = sm.getFileID(loc);
+                auto it = in_scope.find(fid);
+                if (it == in_scope.end()) {
+                    it = in_scope.emplace(fid, scope_.includes_file(sm, fid)).first;
+                }
+                if (it->second) {
+                    decls.push_back(d);
+                }
             }
+            context.setTraversalScope(decls);
         }
-        if (captured_assignments.find(lb.first) != captured_assignments.end()) {
-            std::cout << "    and assignment lhs captures:\n";
-            for (auto capture : captured_assignments[lb.first]) {
-                std::cout << "\t" << capture.first << " of type " << capture.second << "\n";
-            }
+        finder_.matchAST(context);
+        if (times_) {
+            times_->match_ns += PhaseTimes::now_ns() - start;
+        }
+    }
+
+private:
+    clang::ast_matchers::MatchFinder & finder_;
+    MatchScope const &                 scope_;
+    std::unique_ptr<MarkerPrescan>     prescan_;
+    PhaseTimes *                       times_;
+};
+
+// Records every file a translation unit reads, system headers and the inputs of a PCH included
+class DependencyList : public clang::DependencyCollector {
+public:
+    virtual bool needSystemDependencies() override { return true; }
+};
+
+class ScopedMatchAction : public clang::ASTFrontendAction {
+public:
+    // deps, if non-null, receives the names of the files read, and times the phase timings
+    ScopedMatchAction(clang::ast_matchers::MatchFinder & finder, MatchScope const & scope,
+                      std::shared_ptr<DependencyList> deps, PhaseTimes * times)
+        : finder_(finder), scope_(scope), deps_(std::move(deps)), times_(times) {}
+
+protected:
+    virtual bool BeginInvocation(clang::CompilerInstance & ci) override {
+        if (deps_) {
+            ci.addDependencyCollector(deps_);
+        }
+        return true;
+    }
+
+    virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance & ci,
+                                                                  llvm::StringRef) override {
+        std::unique_ptr<MarkerPrescan> prescan;
+        if (scope_.skip_bodies) {
+            // the parser then asks the consumer about each body (Sema itself insists on
+            // parsing constexpr functions and those with deduced return types)
+            ci.getFrontendOpts().SkipFunctionBodies = true;
+            prescan = std::make_unique<MarkerPrescan>(ci.getSourceManager(), ci.getLangOpts());
+        }
+        return std::make_unique<ScopedMatchConsumer>(finder_, scope_, std::move(prescan), times_);
+    }
+
+    virtual void ExecuteAction() override {
+        std::int64_t start = times_ ? PhaseTimes::now_ns() : 0;
+        clang::ASTFrontendAction::ExecuteAction();
+        if (times_) {
+            times_->frontend_ns += PhaseTimes::now_ns() - start;
+        }
+    }
+
+private:
+    clang::ast_matchers::MatchFinder & finder_;
+    MatchScope const &                 scope_;
+    std::shared_ptr<DependencyList>    deps_;
+    PhaseTimes *                       times_;
+};
+
+class ScopedMatchActionFactory : public clang::tooling::FrontendActionFactory {
+public:
+    ScopedMatchActionFactory(clang::ast_matchers::MatchFinder & finder, MatchScope const & scope,
+                             std::shared_ptr<DependencyList> deps = nullptr, PhaseTimes * times = nullptr)
+        : finder_(finder), scope_(scope), deps_(std::move(deps)), times_(times) {}
+
+    virtual std::unique_ptr<clang::FrontendAction> create() override {
+        return std::make_unique<ScopedMatchAction>(finder_, scope_, deps_, times_);
+    }
+
+private:
+    clang::ast_matchers::MatchFinder & finder_;
+    MatchScope const &                 scope_;
+    std::shared_ptr<DependencyList>    deps_;
+    PhaseTimes *                       times_;
+};
+
+// The lambda matcher and its callback, recording into their own AnalysisResults
+// Nothing here is shared, so each translation unit can be analyzed on any thread.
+class LambdaAnalysis {
+public:
+    // profile: have the MatchFinder time each matcher, by its callback's ID
+    explicit LambdaAnalysis(bool profile = false)
+        : lambda_handler_(results_),
+          finder_(finder_options(profile, matcher_times_)) {
+        using namespace clang::ast_matchers;
+        // the handler walks each lambda body itself, so one match per lambda is enough
+        finder_.addMatcher(make_lambda_matcher(anything()), &lambda_handler_);
+    }
+
+    LambdaAnalysis(LambdaAnalysis const&) = delete;
+    LambdaAnalysis& operator=(LambdaAnalysis const&) = delete;
+
+    clang::ast_matchers::MatchFinder & finder() { return finder_; }
+    AnalysisResults & results() { return results_; }
+    llvm::StringMap<llvm::TimeRecord> const & matcher_times() const { return matcher_times_; }
+
+private:
+    static clang::ast_matchers::MatchFinder::MatchFinderOptions
+    finder_options(bool profile, llvm::StringMap<llvm::TimeRecord> & records) {
+        clang::ast_matchers::MatchFinder::MatchFinderOptions options;
+        if (profile) {
+            options.CheckProfiling.emplace(records);
+        }
+        return options;
+    }
+
+    AnalysisResults                     results_;
+    LambdaHandler                       lambda_handler_;
+    llvm::StringMap<llvm::TimeRecord>   matcher_times_;
+    clang::ast_matchers::MatchFinder    finder_;
+};
+
+// A persistent cache of each source's results, so unchanged sources need not be parsed again
+//
+// An entry is named by a hash of the source's compile commands and contents, and of the
+// options that affect the analysis.  It lists the files the source read, with a hash of
+// each one's contents, and is used only while those are unchanged.  The hashes are taken
+// after the parse, and only for files not modified since it began, so they are of what the
+// parse actually read.  Entries are written
+// to a temporary file and renamed into place, so concurrent runs sharing the directory
+// see either the old entry or the new one, never part of one.
+class ResultCache {
+public:
+    // options: anything else the results depend on
+    ResultCache(std::string dir, std::string options)
+        : dir_(std::move(dir)), options_(std::move(options)),
+          good_(!llvm::sys::fs::create_directories(dir_)), hits_(0), misses_(0) {}
+
+    bool good() const { return good_; }
+    std::size_t hits() const { return hits_; }
+    std::size_t misses() const { return misses_; }
+
+    struct Key {
+        std::string hash;           // empty if the source can't be cached
+        std::string directory;      // its compile directory, for relative dependencies
+    };
+
+    Key key(clang::tooling::CompilationDatabase const & compilations, std::string const & source) {
+        llvm::SmallString<256> path(source);
+        llvm::sys::fs::make_absolute(path);
+        llvm::sys::path::remove_dots(path, true);
+        std::vector<clang::tooling::CompileCommand> commands = compilations.getCompileCommands(path);
+        std::string contents = hash_file(path.str().str());
+        if (commands.empty() || contents.empty()) {
+            return Key();
+        }
+        llvm::MD5 h;
+        h.update(format_version());
+        h.update(options_);
+        for (clang::tooling::CompileCommand const & cmd : commands) {
+            for (std::string const & field : cmd.CommandLine) {
+                h.update(field);
+                h.update(llvm::StringRef("", 1));
+            }
+            h.update(cmd.Directory);
+            h.update(llvm::StringRef("", 1));
+            h.update(cmd.Filename);
+            h.update(llvm::StringRef("", 1));
+        }
+        h.update(contents);
+        llvm::MD5::MD5Result result;
+        h.final(result);
+        return Key{result.digest().str().str(), commands.front().Directory};
+    }
+
+    // fill in results from the entry for key, if it is there and still valid
+    bool lookup(Key const & key, AnalysisResults & results) {
+        auto buffer = llvm::MemoryBuffer::getFile(entry_path(key));
+        if (!buffer || !parse_entry((*buffer)->getBuffer(), results)) {
+            misses_++;
+            return false;
+        }
+        hits_++;
+        return true;
+    }
+
+    // deps: the files the source read; any under skip_prefix (temporary files) are left out
+    // parse_start: when the parse that read them began
+    void store(Key const & key, llvm::ArrayRef<std::string> deps, std::string const & skip_prefix,
+               llvm::sys::TimePoint<> parse_start, AnalysisResults const & results) {
+        std::string entry = format_version().str() + "\n";
+        std::vector<std::pair<std::string, std::string> > hashed;
+        for (std::string const & dep : deps) {
+            llvm::SmallString<256> path(dep);
+            llvm::sys::fs::make_absolute(key.directory, path);
+            llvm::sys::path::remove_dots(path, true);
+            if (!skip_prefix.empty() && path.str().startswith(skip_prefix)) {
+                continue;
+            }
+            // hashed first, so a change made before the hash shows in the time checked after
+            std::string hash = hash_file(path.str().str());
+            if (hash.empty()) {
+                return;             // gone already; don't record something we can't check
+            }
+            llvm::sys::fs::file_status status;
+            if (llvm::sys::fs::status(path, status) ||
+                (status.getLastModificationTime() + mtime_resolution() > parse_start)) {
+                return;             // perhaps changed since the parse read it
+            }
+            hashed.emplace_back(path.str().str(), hash);
+        }
+        put_count(entry, hashed.size());
+        for (auto const & dep : hashed) {
+            put(entry, dep.first);
+            put(entry, dep.second);
+        }
+        put_count(entry, results.lambdas.size());
+        for (LambdaRecord const & lambda : results.lambdas) {
+            put(entry, lambda.name);
+            put(entry, lambda.body);
+            put_count(entry, lambda.use_count);
+            for (CaptureUse const & use : results.uses_of(lambda)) {
+                put_count(entry, static_cast<std::size_t>(use.kind));
+                put(entry, use.var);
+                put(entry, use.type);
+            }
+        }
+        put_count(entry, results.replacements.size());
+        for (auto const & rs : results.replacements) {
+            put(entry, rs.first);
+            put_count(entry, rs.second.size());
+            for (clang::tooling::Replacement const & r : rs.second) {
+                put(entry, r.getFilePath());
+                put_count(entry, r.getOffset());
+                put_count(entry, r.getLength());
+                put(entry, r.getReplacementText());
+            }
+        }
+
+        int fd;
+        llvm::SmallString<256> temp;
+        if (llvm::sys::fs::createUniqueFile(dir_ + "/tmp-%%%%%%%%%%%%", fd, temp)) {
+            return;
+        }
+        bool written;
+        {
+            llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+            out << entry;
+            out.flush();
+            written = !out.has_error();
+            out.clear_error();
+        }
+        if (!written || llvm::sys::fs::rename(temp, entry_path(key))) {
+            llvm::sys::fs::remove(temp);
+        }
+    }
+
+private:
+    static llvm::StringRef format_version() { return "rs2-cache-3"; }
+
+    std::string entry_path(Key const & key) const { return dir_ + "/" + key.hash; }
+
+    // the coarsest modification times we expect (FAT's); a file changed this soon before a
+    // parse began may show a time before it
+    static std::chrono::seconds mtime_resolution() { return std::chrono::seconds(2); }
+
+    // the hash of a file's contents, or empty if it can't be read
+    static std::string hash_file(std::string const & path) {
+        auto buffer = llvm::MemoryBuffer::getFile(path);
+        if (!buffer) {
+            return std::string();
+        }
+        llvm::MD5 h;
+        h.update((*buffer)->getBuffer());
+        llvm::MD5::MD5Result result;
+        h.final(result);
+        return result.digest().str().str();
+    }
+
+    // the same, for checking entries
+    // Most headers are read by many sources, so hashes are kept for the rest of the run.
+    std::string file_hash(std::string const & path) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = file_hashes_.find(path);
+            if (it != file_hashes_.end()) {
+                return it->second;
+            }
+        }
+        std::string hash = hash_file(path);
+        std::lock_guard<std::mutex> lock(mutex_);
+        file_hashes_[path] = hash;
+        return hash;
+    }
+
+    // fields are length-prefixed, "<size>:<bytes>", each followed by a newline
+    static void put(std::string & out, llvm::StringRef field) {
+        out += std::to_string(field.size());
+        out += ':';
+        out += field.str();
+        out += '\n';
+    }
+    static void put_count(std::string & out, std::size_t n) { put(out, std::to_string(n)); }
+
+    static bool get(llvm::StringRef & in, llvm::StringRef & field) {
+        std::size_t colon = in.find(':');
+        std::size_t size;
+        if ((colon == llvm::StringRef::npos) || in.substr(0, colon).getAsInteger(10, size) ||
+            (in.size() < colon + 1 + size + 1)) {
+            return false;
+        }
+        field = in.substr(colon + 1, size);
+        in = in.drop_front(colon + 1 + size + 1);
+        return true;
+    }
+    static bool get_count(llvm::StringRef & in, std::size_t & n) {
+        llvm::StringRef field;
+        return get(in, field) && !field.getAsInteger(10, n);
+    }
+
+    bool parse_entry(llvm::StringRef in, AnalysisResults & results) {
+        if (!in.consume_front(format_version()) || !in.consume_front("\n")) {
+            return false;
+        }
+        AnalysisResults r;
+        std::size_t count;
+        llvm::StringRef a, b, c;
+        if (!get_count(in, count)) {
+            return false;
+        }
+        for (std::size_t i = 0; i < count; ++i) {
+            if (!get(in, a) || !get(in, b) || (file_hash(a.str()) != b)) {
+                return false;     // a dependency has changed (or the entry is damaged)
+            }
+        }
+        if (!get_count(in, count)) {
+            return false;
+        }
+        for (std::size_t i = 0; i < count; ++i) {
+            std::size_t uses, kind;
+            if (!get(in, a) || !get(in, b) || !get_count(in, uses)) {
+                return false;
+            }
+            LambdaRecord lambda{r.intern(a), r.save(b), static_cast<std::uint32_t>(r.uses.size()),
+                                static_cast<std::uint32_t>(uses)};
+            for (std::size_t u = 0; u < uses; ++u) {
+                if (!get_count(in, kind) || (kind > static_cast<std::size_t>(CaptureUseKind::Last)) ||
+                    !get(in, b) || !get(in, c)) {
+                    return false;     // including kinds from a newer version
+                }
+                r.uses.push_back(CaptureUse{static_cast<CaptureUseKind>(kind), r.intern(b), r.intern(c)});
+            }
+            r.lambdas.push_back(lambda);
+        }
+        if (!get_count(in, count)) {
+            return false;
+        }
+        for (std::size_t i = 0; i < count; ++i) {
+            std::size_t edits, offset, length;
+            if (!get(in, a) || !get_count(in, edits)) {
+                return false;
+            }
+            clang::tooling::Replacements & file_edits = r.replacements[a.str()];
+            for (std::size_t e = 0; e < edits; ++e) {
+                if (!get(in, b) || !get_count(in, offset) || !get_count(in, length) || !get(in, c)) {
+                    return false;
+                }
+                llvm::consumeError(file_edits.add(clang::tooling::Replacement(b, offset, length, c)));
+            }
+        }
+        results = std::move(r);
+        return true;
+    }
+
+    std::string                         dir_;
+    std::string                         options_;
+    bool                                good_;
+    std::atomic<std::size_t>            hits_;
+    std::atomic<std::size_t>            misses_;
+    std::mutex                          mutex_;
+    std::map<std::string, std::string>  file_hashes_;
+};
+
+// Call f(i) for each i in [0, count) on a pool of threads
+// Workers claim the next index from a shared counter, so long and short jobs balance out.
+template <typename F>
+void for_each_parallel(std::size_t count, unsigned thread_count, F f) {
+    std::atomic<std::size_t> next(0);
+    auto worker = [&]() {
+        for (std::size_t i = next++; i < count; i = next++) {
+            f(i);
+        }
+    };
+    thread_count = std::max<std::size_t>(1, std::min<std::size_t>(thread_count, count));
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < thread_count; ++t) {
+        pool.emplace_back(worker);
+    }
+    for (std::thread & t : pool) {
+        t.join();
+    }
+}
+
+// Stage 1's rewriting of one source, with --stage1-macro
+struct Stage1Output {
+    stage1_result result = stage1_result::failed;
+    std::string   text;
+    std::string   errors;
+};
+
+// Hands sources from the stage 1 workers to the stage 2 workers as each is preprocessed
+// Stage 1 claims sources in order and publishes each when done; stage 2 takes them in the
+// order they were published.  A source is in flight from its claim until stage 2 releases
+// it, and no more are claimed while `capacity` are, which bounds the rewritten text held.
+class Stage1Handoff {
+public:
+    Stage1Handoff(std::size_t count, std::size_t capacity)
+        : count_(count), capacity_(std::max<std::size_t>(1, capacity)) {}
+
+    // stage 1: the next source to preprocess, or false if there are none left
+    bool claim(std::size_t & i) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        room_.wait(lock, [this]() { return (in_flight_ < capacity_) || (next_ == count_); });
+        if (next_ == count_) {
+            return false;
+        }
+        i = next_++;
+        ++in_flight_;
+        return true;
+    }
+
+    void publish(std::size_t i) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ready_.push_back(i);
+        ++published_;
+        ready_cv_.notify_all();
+    }
+
+    // stage 2: the next preprocessed source, once there is one, or false if all are taken
+    bool take(std::size_t & i) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_cv_.wait(lock, [this]() { return !ready_.empty() || (published_ == count_); });
+        if (ready_.empty()) {
+            return false;
+        }
+        i = ready_.front();
+        ready_.pop_front();
+        return true;
+    }
+
+    // stage 2 is done with a source it took
+    void release() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --in_flight_;
+        room_.notify_one();
+    }
+
+private:
+    std::size_t              count_;
+    std::size_t              capacity_;
+    std::size_t              next_ = 0;
+    std::size_t              published_ = 0;
+    std::size_t              in_flight_ = 0;
+    std::deque<std::size_t>  ready_;
+    std::mutex               mutex_;
+    std::condition_variable  room_;
+    std::condition_variable  ready_cv_;
+};
+
+// Writes each source's results as NDJSON as soon as it is done, with --ndjson
+// A "run" record comes first, once the run is set up and about to start on the sources;
+// every later record names its source.  A source's lambdas (with their capture uses) and
+// replacements come first, then a record for the source itself, with its status, so a
+// reader knows when it has everything for that source.  Sources appear as they finish.
+class NDJSONWriter {
+public:
+    explicit NDJSONWriter(std::string const & path) : out_(path, ec_) {}
+
+    std::error_code error() const { return ec_; }
+
+    void start(std::size_t sources) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        out_ << llvm::json::Value(llvm::json::Object{
+            {"record", "run"}, {"sources", static_cast<std::int64_t>(sources)}}) << "\n";
+        out_.flush();
+    }
+
+    // ms: how long the source took
+    void write(std::string const & source, int status, double ms, AnalysisResults const & results) {
+        // formatted first, then written (and flushed) in one go, so records from different
+        // sources never interleave
+        std::string text;
+        llvm::raw_string_ostream os(text);
+        for (LambdaRecord const & lambda : results.lambdas) {
+            llvm::json::Array uses;
+            for (CaptureUse const & use : results.uses_of(lambda)) {
+                uses.push_back(llvm::json::Object{
+                    {"var", use.var}, {"type", use.type}, {"use", capture_use_name(use.kind)}});
+            }
+            os << llvm::json::Value(llvm::json::Object{
+                {"record", "lambda"}, {"source", source}, {"name", lambda.name},
+                {"body", lambda.body}, {"captures", std::move(uses)}}) << "\n";
+        }
+        std::size_t edits = 0;
+        for (auto const & rs : results.replacements) {
+            for (clang::tooling::Replacement const & r : rs.second) {
+                os << llvm::json::Value(llvm::json::Object{
+                    {"record", "replacement"}, {"source", source}, {"file", r.getFilePath()},
+                    {"offset", r.getOffset()}, {"length", r.getLength()},
+                    {"text", r.getReplacementText()}}) << "\n";
+                ++edits;
+            }
+        }
+        os << llvm::json::Value(llvm::json::Object{
+            {"record", "source"}, {"source", source}, {"status", status}, {"ms", ms},
+            {"lambdas", static_cast<std::int64_t>(results.lambdas.size())},
+            {"replacements", static_cast<std::int64_t>(edits)}}) << "\n";
+        os.flush();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        out_ << text;
+        out_.flush();
+    }
+
+private:
+    std::error_code      ec_;
+    llvm::raw_fd_ostream out_;
+    std::mutex           mutex_;
+};
+
+// Apply each file's edits with --apply: one pass over its text, written to a temporary file
+// beside it that is then renamed over it, so no reader sees it half written
+bool apply_replacements(AnalysisResults::replacement_map const & replacements, unsigned thread_count) {
+    std::vector<AnalysisResults::replacement_map::const_iterator> files;
+    for (auto it = replacements.begin(); it != replacements.end(); ++it) {
+        if (!it->second.empty()) {
+            files.push_back(it);
+        }
+    }
+    std::atomic<std::size_t> failures(0), edits(0);
+    for_each_parallel(files.size(), thread_count, [&](std::size_t f) {
+        std::string const & path = files[f]->first;
+        clang::tooling::Replacements const & file_edits = files[f]->second;
+        auto fail = [&](llvm::Twine const & why) {
+            llvm::errs() << "cannot apply edits to " << path << ": " << why << "\n";
+            failures++;
+        };
+        auto buffer = llvm::MemoryBuffer::getFile(path);
+        if (!buffer) {
+            return fail(buffer.getError().message());
+        }
+        llvm::Expected<std::string> text = clang::tooling::applyAllReplacements((*buffer)->getBuffer(), file_edits);
+        if (!text) {
+            return fail(llvm::toString(text.takeError()));
+        }
+        int fd;
+        llvm::SmallString<256> temp;
+        if (std::error_code ec = llvm::sys::fs::createUniqueFile(path + ".rs2-%%%%%%", fd, temp)) {
+            return fail(ec.message());
+        }
+        bool written;
+        {
+            llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+            out << *text;
+            out.flush();
+            written = !out.has_error();
+            out.clear_error();
+        }
+        auto perms = llvm::sys::fs::getPermissions(path);
+        if (perms) {
+            llvm::sys::fs::setPermissions(temp, *perms);
+        }
+        if (!written) {
+            llvm::sys::fs::remove(temp);
+            return fail("write failed");
+        }
+        if (std::error_code ec = llvm::sys::fs::rename(temp, path)) {
+            llvm::sys::fs::remove(temp);
+            return fail(ec.message());
+        }
+        edits += file_edits.size();
+    });
+    llvm::errs() << "applied " << edits.load() << " edits to " << (files.size() - failures.load()) << " files";
+    if (failures) {
+        llvm::errs() << " (" << failures.load() << " could not be changed)";
+    }
+    llvm::errs() << "\n";
+    return failures == 0;
+}
+
+// Read back NDJSON records, as NDJSONWriter writes them, for the sources in index, filling
+// in the results, status and run time of each source whose closing "source" record is
+// present.  Records of a source that was never closed (its writer died) are dropped.
+void read_ndjson_results(llvm::StringRef text, llvm::StringMap<std::size_t> const & index,
+                         std::vector<AnalysisResults> & results, std::vector<int> & status,
+                         std::vector<double> & ms, std::vector<char> & done) {
+    std::map<std::size_t, AnalysisResults> pending;
+    while (!text.empty()) {
+        llvm::StringRef line;
+        std::tie(line, text) = text.split('\n');
+        llvm::Expected<llvm::json::Value> value = llvm::json::parse(line);
+        if (!value) {
+            llvm::consumeError(value.takeError());      // e.g. a line cut short
+            continue;
+        }
+        llvm::json::Object const * record = value->getAsObject();
+        auto kind = record ? record->getString("record") : llvm::None;
+        auto source = record ? record->getString("source") : llvm::None;
+        auto found = source ? index.find(*source) : index.end();
+        if (!kind || (found == index.end())) {
+            continue;
+        }
+        std::size_t i = found->second;
+        AnalysisResults & r = pending[i];
+        if (*kind == "lambda") {
+            auto name = record->getString("name");
+            auto body = record->getString("body");
+            llvm::json::Array const * captures = record->getArray("captures");
+            if (!name || !body || !captures) {
+                continue;
+            }
+            LambdaRecord lambda{r.intern(*name), r.save(*body), static_cast<std::uint32_t>(r.uses.size()), 0};
+            for (llvm::json::Value const & c : *captures) {
+                llvm::json::Object const * capture = c.getAsObject();
+                if (!capture) {
+                    continue;
+                }
+                auto var = capture->getString("var");
+                auto type = capture->getString("type");
+                auto use = capture->getString("use");
+                CaptureUseKind use_kind;
+                if (var && type && use && parse_capture_use_name(*use, use_kind)) {
+                    r.uses.push_back(CaptureUse{use_kind, r.intern(*var), r.intern(*type)});
+                }
+            }
+            lambda.use_count = static_cast<std::uint32_t>(r.uses.size() - lambda.first_use);
+            r.lambdas.push_back(lambda);
+        } else if (*kind == "replacement") {
+            auto file = record->getString("file");
+            auto offset = record->getInteger("offset");
+            auto length = record->getInteger("length");
+            auto edit = record->getString("text");
+            if (file && offset && length && edit) {
+                llvm::consumeError(r.replacements[file->str()].add(
+                    clang::tooling::Replacement(*file, static_cast<unsigned>(*offset),
+                                                static_cast<unsigned>(*length), *edit)));
+            }
+        } else if (*kind == "source") {
+            auto source_status = record->getInteger("status");
+            results[i] = std::move(r);
+            status[i] = source_status ? static_cast<int>(*source_status) : 1;
+            ms[i] = record->getNumber("ms").getValueOr(0.0);
+            done[i] = true;
+            pending.erase(i);
+        }
+    }
+}
+
+// run time by source, from the "source" records of earlier --ndjson output
+std::map<std::string, double> read_past_runtimes(std::string const & path) {
+    std::map<std::string, double> ms;
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) {
+        llvm::errs() << "cannot read " << path << "; balancing shards by file size\n";
+        return ms;
+    }
+    llvm::SmallVector<llvm::StringRef, 0> lines;
+    (*buffer)->getBuffer().split(lines, '\n', -1, false);
+    for (llvm::StringRef line : lines) {
+        llvm::Expected<llvm::json::Value> value = llvm::json::parse(line);
+        if (!value) {
+            llvm::consumeError(value.takeError());
+            continue;
+        }
+        llvm::json::Object const * record = value->getAsObject();
+        if (record && (record->getString("record") == llvm::StringRef("source"))) {
+            auto source = record->getString("source");
+            auto source_ms = record->getNumber("ms");
+            if (source && source_ms) {
+                ms[source->str()] = *source_ms;
+            }
+        }
+    }
+    return ms;
+}
+
+// The shard, of count, for each source: heaviest first, each to the shard with the least
+// work so far.  Weights are past run times where known (the average of those for any new
+// source), file sizes otherwise.  The assignment depends only on the sources and weights,
+// so separate processes agree on it.
+std::vector<unsigned> assign_shards(std::vector<std::string> const & sources, unsigned count,
+                                    std::map<std::string, double> const & past_ms) {
+    std::vector<double> weight(sources.size(), -1.0);
+    double known_ms = 0;
+    std::size_t known = 0;
+    for (std::size_t i = 0; i < sources.size(); ++i) {
+        auto it = past_ms.find(sources[i]);
+        if (it != past_ms.end()) {
+            weight[i] = it->second;
+            known_ms += it->second;
+            ++known;
+        }
+    }
+    for (std::size_t i = 0; i < sources.size(); ++i) {
+        if (weight[i] >= 0) {
+            continue;
+        }
+        if (known) {
+            weight[i] = known_ms / known;
+        } else {
+            std::uint64_t size = 0;
+            llvm::sys::fs::file_size(sources[i], size);
+            weight[i] = static_cast<double>(size);
+        }
+    }
+
+    std::vector<std::size_t> order(sources.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&](std::size_t a, std::size_t b) { return weight[a] > weight[b]; });
+    std::vector<double> load(count, 0.0);
+    std::vector<std::size_t> taken(count, 0);
+    std::vector<unsigned> shard(sources.size(), 0);
+    for (std::size_t i : order) {
+        // of shards with the same load (as when weights are zero), the one with fewest sources
+        unsigned lightest = 0;
+        for (unsigned s = 1; s < count; ++s) {
+            if (std::tie(load[s], taken[s]) < std::tie(load[lightest], taken[lightest])) {
+                lightest = s;
+            }
+        }
+        shard[i] = lightest;
+        load[lightest] += weight[i];
+        ++taken[lightest];
+    }
+    return shard;
+}
+
+// Our command line, less the options a supervisor handles itself, for its workers
+std::vector<std::string> worker_args(int argc, char const ** argv) {
+    static char const * const own_flags[] = {"apply"};
+    static char const * const own_values[] = {"supervise", "j", "ndjson", "shard", "shard-weights",
+                                              "sources-from", "profile-json", "tu-timeout",
+                                              "tu-memory", "retries"};
+    auto one_of = [](llvm::StringRef name, llvm::ArrayRef<char const *> names) {
+        return std::find_if(names.begin(), names.end(),
+                            [&](char const * n) { return name == n; }) != names.end();
+    };
+    std::vector<std::string> args;
+    for (int a = 1; a < argc; ++a) {
+        llvm::StringRef arg(argv[a]);
+        if (arg == "--") {
+            args.insert(args.end(), argv + a, argv + argc);     // the compiler's
+            break;
+        }
+        llvm::StringRef name = arg.ltrim('-');
+        if (name.size() == arg.size()) {
+            args.push_back(arg.str());      // a source
+            continue;
+        }
+        bool value_attached = name.find('=') != llvm::StringRef::npos;
+        name = name.split('=').first;
+        if (one_of(name, own_flags)) {
+            continue;
+        }
+        if (one_of(name, own_values)) {
+            a += value_attached ? 0 : 1;
+            continue;
+        }
+        args.push_back(arg.str());
+    }
+    return args;
+}
+
+// The --supervise driver
+// Worker processes (this program, with the same options, on one thread, writing NDJSON) each
+// take a batch of sources; initially the batches are the shards.  A worker that crashes,
+// exceeds its memory limit, or finishes no source for --tu-timeout seconds is stopped.  It
+// takes its sources in order, so the first without results is the one that stopped it: that
+// one is retried alone, up to --retries times, then quarantined, and the rest of the batch
+// goes back in the queue.  A worker that exits with an error before finishing its batch
+// (Clang's fatal errors exit with status 1) is handled the same way, unless it wrote no
+// output at all, not even the "run" record it starts with: then it failed before reaching
+// any source (bad options, an unwritable output file), as every worker would, so the run
+// stops rather than retrying every source in turn.  Results are read back from the workers'
+// output and stored by source, so they merge in source order just as in a single process.
+// Returns false if the workers could not be run or failed that way.
+bool supervise(char const * argv0, std::vector<std::string> const & args,
+               std::vector<std::string> const & sources, unsigned count,
+               std::map<std::string, double> const & past_ms,
+               std::vector<AnalysisResults> & results, std::vector<int> & status,
+               std::vector<double> & ms) {
+    using clock = std::chrono::steady_clock;
+    static int anchor;
+    std::string const program = llvm::sys::fs::getMainExecutable(argv0, &anchor);
+    llvm::SmallString<128> dir;
+    if (llvm::sys::fs::createUniqueDirectory("rs2-shards", dir)) {
+        llvm::errs() << "cannot create a directory for the workers' output\n";
+        return false;
+    }
+
+    llvm::StringMap<std::size_t> index;
+    for (std::size_t i = 0; i < sources.size(); ++i) {
+        index[sources[i]] = i;
+    }
+    std::vector<char> done(sources.size(), false);
+
+    struct Batch {
+        std::vector<std::size_t> sources;
+        unsigned                 failures;     // of this batch, when it is a single source
+    };
+    struct Worker {
+        Batch                   batch;
+        llvm::sys::ProcessInfo  process;
+        std::string             output;
+        std::uint64_t           scanned;       // bytes of output checked for finished sources
+        clock::time_point       progress;      // when it started, or last finished a source
+    };
+
+    std::deque<Batch> queue;
+    std::vector<unsigned> shard = assign_shards(sources, count, past_ms);
+    for (unsigned s = 0; s < count; ++s) {
+        Batch batch{{}, 0};
+        for (std::size_t i = 0; i < sources.size(); ++i) {
+            if (shard[i] == s) {
+                batch.sources.push_back(i);
+            }
+        }
+        if (!batch.sources.empty()) {
+            queue.push_back(std::move(batch));
+        }
+    }
+
+    std::vector<Worker> running;
+    std::size_t launched = 0, quarantined = 0;
+    auto launch = [&](Batch batch) {
+        std::string stem = (llvm::Twine(dir) + "/batch-" + llvm::Twine(launched++)).str();
+        std::string list = stem + ".txt", output = stem + ".ndjson";
+        {
+            std::error_code ec;
+            llvm::raw_fd_ostream out(list, ec);
+            for (std::size_t i : batch.sources) {
+                out << sources[i] << "\n";
+            }
+        }
+        std::vector<std::string> command{program, "-j", "1", "--ndjson", output, "--sources-from", list};
+        command.insert(command.end(), args.begin(), args.end());
+        std::vector<llvm::StringRef> command_refs(command.begin(), command.end());
+        std::string error;
+        bool failed = false;
+        // the limit is in MB, as --tu-memory is; LLVM sets it as RLIMIT_DATA, which on Linux
+        // covers mmap as well as the heap, so an allocation past it fails and the worker aborts
+        llvm::sys::ProcessInfo process = llvm::sys::ExecuteNoWait(program, command_refs, llvm::None, {},
+                                                                  TUMemory, &error, &failed);
+        if (failed) {
+            llvm::errs() << "cannot run " << program << ": " << error << "\n";
+            return false;
+        }
+        running.push_back(Worker{std::move(batch), process, output, 0, clock::now()});
+        return true;
+    };
+
+    // whether the worker has finished another source since last asked: its output has gained
+    // a complete "source" record (written, with the rest of the source's, in one flush)
+    auto finished_another = [](Worker & worker) {
+        std::uint64_t size = 0;
+        if (llvm::sys::fs::file_size(worker.output, size) || (size <= worker.scanned)) {
+            return false;
+        }
+        llvm::Expected<llvm::sys::fs::file_t> fd = llvm::sys::fs::openNativeFileForRead(worker.output);
+        if (!fd) {
+            llvm::consumeError(fd.takeError());
+            return false;
+        }
+        auto added = llvm::MemoryBuffer::getOpenFileSlice(*fd, worker.output, size - worker.scanned,
+                                                          static_cast<std::int64_t>(worker.scanned),
+                                                          /*IsVolatile=*/true);
+        llvm::sys::fs::closeFile(*fd);
+        if (!added) {
+            return false;
+        }
+        // whole lines only; a partly written one is read again next time
+        llvm::StringRef text = (*added)->getBuffer();
+        std::size_t end = text.rfind('\n');
+        if (end == llvm::StringRef::npos) {
+            return false;
+        }
+        text = text.take_front(end + 1);
+        worker.scanned += text.size();
+        return text.find("\"record\":\"source\"") != llvm::StringRef::npos;
+    };
+
+    bool ok = true;
+
+    // take in what a worker finished, and requeue what it didn't
+    // crashed: whether it was stopped by a signal (ours, on a timeout, or its own)
+    auto collect = [&](Worker & worker, std::string const & why, bool crashed) {
+        auto buffer = llvm::MemoryBuffer::getFile(worker.output);
+        bool const started = buffer && !(*buffer)->getBuffer().empty();
+        if (buffer) {
+            read_ndjson_results((*buffer)->getBuffer(), index, results, status, ms, done);
+        }
+        std::vector<std::size_t> unfinished;
+        for (std::size_t i : worker.batch.sources) {
+            if (!done[i]) {
+                unfinished.push_back(i);
+            }
+        }
+        if (unfinished.empty()) {
+            return;
+        }
+        if (!crashed && !started) {
+            llvm::errs() << "a worker exited (" << why << ") before starting on its " << unfinished.size()
+                         << " sources, from " << sources[unfinished.front()] << "; stopping\n";
+            for (std::size_t i : unfinished) {
+                status[i] = 1;
+            }
+            ok = false;
+            return;
+        }
+        std::size_t culprit = unfinished.front();
+        unsigned failures = (worker.batch.sources.size() == 1) ? worker.batch.failures + 1 : 1;
+        if (failures > Retries) {
+            llvm::errs() << "quarantined " << sources[culprit] << " (" << why << ")\n";
+            status[culprit] = 1;
+            ++quarantined;
+        } else {
+            llvm::errs() << sources[culprit] << " stopped its worker (" << why << "); retrying it alone\n";
+            queue.push_back(Batch{{culprit}, failures});
+        }
+        if (unfinished.size() > 1) {
+            queue.push_front(Batch{std::vector<std::size_t>(unfinished.begin() + 1, unfinished.end()), 0});
+        }
+    };
+
+    while (!running.empty() || (ok && !queue.empty())) {
+        while (ok && (running.size() < count) && !queue.empty()) {
+            ok = launch(std::move(queue.front()));
+            queue.pop_front();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        for (std::size_t w = 0; w < running.size();) {
+            Worker & worker = running[w];
+            std::string error;
+            llvm::sys::ProcessInfo exited = llvm::sys::Wait(worker.process, 0, false, &error);
+            if (exited.Pid == 0) {
+                // still running: has it finished a source lately?
+                if (finished_another(worker)) {
+                    worker.progress = clock::now();
+                } else if (TUTimeout && (clock::now() - worker.progress > std::chrono::seconds(TUTimeout.getValue()))) {
+                    ::kill(worker.process.Pid, SIGKILL);
+                    exited = llvm::sys::Wait(worker.process, 0, true);
+                    error = "no source finished in " + std::to_string(TUTimeout.getValue()) + "s";
+                }
+                if (exited.Pid == 0) {
+                    ++w;
+                    continue;
+                }
+            }
+            // Wait gives -2 for a signal (with its name in error) and -1 if the program
+            // could not be run at all
+            bool const crashed = exited.ReturnCode == -2;
+            if (error.empty()) {
+                error = "exit status " + std::to_string(exited.ReturnCode);
+            }
+            collect(worker, error, crashed);
+            running.erase(running.begin() + w);
+        }
+        if (!ok) {
+            // the run has failed: no point waiting for the rest
+            for (Worker & worker : running) {
+                ::kill(worker.process.Pid, SIGKILL);
+                llvm::sys::Wait(worker.process, 0, true);
+            }
+            running.clear();
+        }
+    }
+
+    llvm::sys::fs::remove_directories(dir);
+    llvm::errs() << "supervisor: " << launched << " workers for " << sources.size() << " sources";
+    if (quarantined) {
+        llvm::errs() << ", " << quarantined << " quarantined";
+    }
+    llvm::errs() << "\n";
+    return ok;
+}
+
+// Timings for one source, with --profile-matchers
+struct SourceProfile {
+    bool                           analyzed = false;   // false if taken from the cache, or skipped
+    std::int64_t                   total_ns = 0;       // the whole ClangTool run
+    PhaseTimes                     phases;
+    std::map<std::string, double>  matcher_ms;         // wall time, by matcher (callback) ID
+};
+
+// A table of the timings, slowest sources first, to stderr, and optionally all of them as JSON
+void report_profile(std::vector<std::string> const & sources,
+                    std::vector<SourceProfile> const & profiles,
+                    std::string const & json_path) {
+    std::map<std::string, double> matcher_totals;
+    std::vector<std::size_t> order;
+    for (std::size_t i = 0; i < profiles.size(); ++i) {
+        if (profiles[i].analyzed) {
+            order.push_back(i);
+            for (auto const & m : profiles[i].matcher_ms) {
+                matcher_totals[m.first] += m.second;
+            }
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+        return profiles[a].total_ns > profiles[b].total_ns;
+    });
+
+    // one column per matcher, identified by number in the legend
+    llvm::errs() << "profile: " << order.size() << " sources analyzed\n";
+    std::size_t column = 0;
+    for (auto const & m : matcher_totals) {
+        char line[64];
+        std::snprintf(line, sizeof(line), "  m%zu: %10.2f ms  ", column++, m.second);
+        llvm::errs() << line << m.first << "\n";
+    }
+    char line[128];
+    std::snprintf(line, sizeof(line), "%10s %12s %10s", "total ms", "parse+sema", "match");
+    llvm::errs() << line;
+    for (std::size_t m = 0; m < matcher_totals.size(); ++m) {
+        std::snprintf(line, sizeof(line), " %9s%zu", "m", m);
+        llvm::errs() << line;
+    }
+    llvm::errs() << "  file\n";
+    for (std::size_t i : order) {
+        SourceProfile const & p = profiles[i];
+        std::snprintf(line, sizeof(line), "%10.2f %12.2f %10.2f", p.total_ns / 1e6,
+                      (p.phases.frontend_ns - p.phases.match_ns) / 1e6, p.phases.match_ns / 1e6);
+        llvm::errs() << line;
+        for (auto const & m : matcher_totals) {
+            auto it = p.matcher_ms.find(m.first);
+            std::snprintf(line, sizeof(line), " %10.2f", (it == p.matcher_ms.end()) ? 0.0 : it->second);
+            llvm::errs() << line;
+        }
+        llvm::errs() << "  " << sources[i] << "\n";
+    }
+
+    if (json_path.empty()) {
+        return;
+    }
+    llvm::json::Array files;
+    for (std::size_t i : order) {
+        SourceProfile const & p = profiles[i];
+        llvm::json::Object matchers;
+        for (auto const & m : p.matcher_ms) {
+            matchers[m.first] = m.second;
+        }
+        files.push_back(llvm::json::Object{
+            {"file", sources[i]},
+            {"total_ms", p.total_ns / 1e6},
+            {"parse_sema_ms", (p.phases.frontend_ns - p.phases.match_ns) / 1e6},
+            {"match_ms", p.phases.match_ns / 1e6},
+            {"matchers_ms", std::move(matchers)}});
+    }
+    llvm::json::Object totals;
+    for (auto const & m : matcher_totals) {
+        totals[m.first] = m.second;
+    }
+    std::error_code ec;
+    llvm::raw_fd_ostream out(json_path, ec);
+    if (ec) {
+        llvm::errs() << "cannot write " << json_path << ": " << ec.message() << "\n";
+        return;
+    }
+    out << llvm::formatv("{0:2}", llvm::json::Value(llvm::json::Object{
+        {"sources", std::move(files)},
+        {"matchers_ms", std::move(totals)}})) << "\n";
+}
+
+// The leading run of #include lines of a source file (with any comments and blank lines
+// among them): the part a precompiled header can stand in for
+std::size_t include_block_size(llvm::StringRef text) {
+    clang::LangOptions lang_opts;
+    lang_opts.CPlusPlus = lang_opts.CPlusPlus11 = true;
+    clang::Lexer lexer(clang::SourceLocation(), lang_opts, text.begin(), text.begin(), text.end());
+    clang::Token tok;
+    std::size_t size = 0;
+    lexer.LexFromRawLexer(tok);
+    while (tok.is(clang::tok::hash) && tok.isAtStartOfLine()) {
+        clang::Token name;
+        lexer.LexFromRawLexer(name);
+        if (!name.is(clang::tok::raw_identifier) || (name.getRawIdentifier() != "include")) {
+            break;
+        }
+        // the rest of the directive
+        do {
+            lexer.LexFromRawLexer(tok);
+        } while (!tok.is(clang::tok::eof) && !tok.isAtStartOfLine());
+        // up to the start of the next token (the lexer is just past it)
+        size = tok.is(clang::tok::eof) ? text.size()
+                                       : (lexer.getBufferLocation() - tok.getLength()) - text.begin();
+    }
+    return size;
+}
+
+// The text of source with its include block, which must be includes, replaced by spaces
+// (keeping line breaks, so every offset and line number is the same), or empty if the source
+// no longer starts with that block
+std::string blank_include_block(std::string const & source, llvm::StringRef includes) {
+    auto buffer = llvm::MemoryBuffer::getFile(source);
+    if (!buffer || !(*buffer)->getBuffer().startswith(includes)) {
+        return std::string();
+    }
+    std::string text = (*buffer)->getBuffer().str();
+    std::replace_if(text.begin(), text.begin() + includes.size(),
+                    [](char c) { return (c != '\n') && (c != '\r'); }, ' ');
+    return text;
+}
+
+// A precompiled header for an #include block that several sources start with, compiled
+// with the same flags in the same directory
+// Each source is then parsed with its block blanked out, so the PCH stands in for the block
+// exactly rather than being followed by a second copy of it; headers without include guards
+// are seen once, as they would be without the PCH.
+struct SharedPCH {
+    std::string                             key;          // flags, directories and include block
+    clang::tooling::CompileCommand          command;      // of the first source using it
+    std::string                             includes;     // the block itself
+    std::string                             header_path;  // where the block is written, to compile
+    std::string                             pch_path;
+    std::size_t                             users = 0;
+    bool                                    built = false;
+};
+
+// Find the include blocks sources share, and which PCH (if any) each source can use
+// Sources with more than one compile command, or whose block no other source shares, get none.
+std::vector<SharedPCH> plan_shared_pchs(clang::tooling::CompilationDatabase const & compilations,
+                                        std::vector<std::string> const & sources,
+                                        std::string const & pch_dir,
+                                        std::vector<int> & source_pch) {
+    using namespace clang::tooling;
+    std::vector<SharedPCH> pchs;
+    std::map<std::string, std::size_t> by_key;
+    source_pch.assign(sources.size(), -1);
+    for (std::size_t i = 0; i < sources.size(); ++i) {
+        llvm::SmallString<256> path(sources[i]);
+        llvm::sys::fs::make_absolute(path);
+        llvm::sys::path::remove_dots(path, true);
+        std::vector<CompileCommand> commands = compilations.getCompileCommands(path);
+        if (commands.size() != 1) {
+            continue;
+        }
+        auto buffer = llvm::MemoryBuffer::getFile(path);
+        if (!buffer) {
+            continue;
+        }
+        llvm::StringRef text = (*buffer)->getBuffer();
+        std::size_t block = include_block_size(text);
+        if (block == 0) {
+            continue;
+        }
+
+        // flags that affect the PCH: everything but the source and output files
+        CompileCommand const & cmd = commands.front();
+        CommandLineArguments args = getClangStripDependencyFileAdjuster()(
+            getClangStripOutputAdjuster()(cmd.CommandLine, cmd.Filename), cmd.Filename);
+        std::string key;
+        for (std::string const & arg : args) {
+            if (arg != cmd.Filename) {
+                key += arg;
+                key += '\0';
+            }
+        }
+        key += cmd.Directory + '\0' + llvm::sys::path::parent_path(path).str() + '\0';
+        key += text.substr(0, block).str();
+
+        auto it = by_key.find(key);
+        if (it == by_key.end()) {
+            it = by_key.emplace(key, pchs.size()).first;
+            SharedPCH pch;
+            pch.key = key;
+            pch.command = cmd;
+            pch.includes = text.substr(0, block).str();
+            std::string stem = pch_dir + "/prefix" + std::to_string(pchs.size());
+            pch.header_path = stem + ".h";
+            pch.pch_path = stem + ".pch";
+            pchs.push_back(std::move(pch));
+        }
+        pchs[it->second].users++;
+        source_pch[i] = static_cast<int>(it->second);
+    }
+    // a PCH only pays for itself if it is used more than once
+    for (std::size_t i = 0; i < sources.size(); ++i) {
+        if ((source_pch[i] >= 0) && (pchs[source_pch[i]].users < 2)) {
+            source_pch[i] = -1;
+        }
+    }
+    return pchs;
+}
+
+// Compile the include block to a PCH with the flags of the first source that uses it
+// Quoted includes are looked up relative to the header (alone in its temporary directory)
+// first, so the source's directory is added with -iquote, ahead of any others, to find what
+// the source itself would have.
+bool build_shared_pch(SharedPCH & pch) {
+    using namespace clang::tooling;
+    {
+        std::error_code ec;
+        llvm::raw_fd_ostream header(pch.header_path, ec);
+        if (ec) {
+            return false;
+        }
+        header << pch.includes;
+    }
+
+    CompileCommand const & cmd = pch.command;
+    CommandLineArguments args = getClangStripDependencyFileAdjuster()(
+        getClangStripOutputAdjuster()(cmd.CommandLine, cmd.Filename), cmd.Filename);
+    llvm::SmallString<256> source(cmd.Filename);
+    llvm::sys::fs::make_absolute(cmd.Directory, source);
+    CommandLineArguments pch_args;
+    for (std::size_t a = 0; a < args.size(); ++a) {
+        if (args[a] == cmd.Filename) {
+            pch_args.insert(pch_args.end(), {"-x", "c++-header", pch.header_path});
+        } else if (args[a] != "-c") {
+            pch_args.push_back(args[a]);
+        }
+        if (a == 0) {
+            // just after the compiler
+            pch_args.insert(pch_args.end(), {"-iquote", llvm::sys::path::parent_path(source).str()});
+        }
+    }
+    pch_args.insert(pch_args.end(), {"-o", pch.pch_path});
+
+    llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs(llvm::vfs::createPhysicalFileSystem().release());
+    fs->setCurrentWorkingDirectory(cmd.Directory);
+    llvm::IntrusiveRefCntPtr<clang::FileManager> files(new clang::FileManager(clang::FileSystemOptions(), fs));
+    ToolInvocation invocation(pch_args, std::make_unique<clang::GeneratePCHAction>(), files.get());
+    return invocation.run();
+}
+
+int main(int argc, char const **argv) {
+    using namespace clang;
+    using namespace clang::tooling;
+
+    // sources may instead come from --sources-from
+    auto opt = CommonOptionsParser::create(argc, argv, ToolingSampleCategory, llvm::cl::ZeroOrMore);
+    if (!opt) {
+        llvm::errs() << llvm::toString(opt.takeError());
+        return 1;
+    }
+    std::vector<std::string> sources = opt->getSourcePathList();
+    if (!SourcesFrom.empty()) {
+        auto list = llvm::MemoryBuffer::getFile(SourcesFrom);
+        if (!list) {
+            llvm::errs() << "cannot read " << SourcesFrom << ": " << list.getError().message() << "\n";
+            return 1;
+        }
+        llvm::SmallVector<llvm::StringRef, 16> lines;
+        (*list)->getBuffer().split(lines, '\n', -1, false);
+        sources.clear();
+        for (llvm::StringRef line : lines) {
+            sources.push_back(line.str());
+        }
+    }
+    if (sources.empty()) {
+        llvm::errs() << "no sources given\n";
+        return 1;
+    }
+    std::map<std::string, double> past_ms;
+    if (!ShardWeights.empty()) {
+        past_ms = read_past_runtimes(ShardWeights);
+    }
+    if (!Shard.empty()) {
+        std::pair<llvm::StringRef, llvm::StringRef> parts = llvm::StringRef(Shard).split('/');
+        unsigned shard = 0, shard_count = 0;
+        if (parts.first.getAsInteger(10, shard) || parts.second.getAsInteger(10, shard_count) ||
+            (shard >= shard_count)) {
+            llvm::errs() << "--shard must be i/N, with i less than N\n";
+            return 1;
+        }
+        std::vector<unsigned> assignment = assign_shards(sources, shard_count, past_ms);
+        std::vector<std::string> mine;
+        for (std::size_t i = 0; i < sources.size(); ++i) {
+            if (assignment[i] == shard) {
+                mine.push_back(sources[i]);
+            }
+        }
+        sources.swap(mine);
+    }
+
+    MatchScope scope;
+    scope.all_decls = AllDecls;
+    scope.skip_bodies = SkipBodies;
+    for (std::string const & path : MatchPaths) {
+        // compared with the real paths of the files declarations come from
+        llvm::SmallString<256> real;
+        if (llvm::sys::fs::real_path(path, real)) {
+            llvm::errs() << "ignoring --match-path " << path << ": not found\n";
+            continue;
+        }
+        scope.paths.push_back(real.str().str());
+    }
+
+    unsigned thread_count = JobCount ? JobCount.getValue() : std::max(1u, std::thread::hardware_concurrency());
+
+    // Stage 1 output never reaches the disk, and has no #include block left to share
+    bool const fused = !Stage1Macros.empty();
+    if (fused && !Supervise && (SharePCH || !CacheDir.empty())) {
+        llvm::errs() << "--pch and --cache do not apply to stage 1 output; ignoring them\n";
+    }
+    if (fused && ApplyEdits) {
+        llvm::errs() << "--apply cannot be used with --stage1-macro: the edits would be to stage 1 "
+                        "output, which is never written\n";
+        return 1;
+    }
+    if (Supervise && ProfileMatchers) {
+        llvm::errs() << "--profile-matchers cannot be used with --supervise: each worker's profile "
+                        "would be lost with its output\n";
+        return 1;
+    }
+
+    // shared include blocks, precompiled up front
+    std::vector<SharedPCH> pchs;
+    std::vector<int>       source_pch(sources.size(), -1);
+    llvm::SmallString<128> pch_dir;
+    if (SharePCH && !fused && !Supervise) {
+        if (llvm::sys::fs::createUniqueDirectory("rs2-pch", pch_dir)) {
+            llvm::errs() << "cannot create a directory for precompiled headers; continuing without\n";
+        } else {
+            pchs = plan_shared_pchs(opt->getCompilations(), sources, pch_dir.str().str(), source_pch);
+            std::vector<std::size_t> needed;
+            for (std::size_t p = 0; p < pchs.size(); ++p) {
+                if (pchs[p].users > 1) {
+                    needed.push_back(p);
+                }
+            }
+            for_each_parallel(needed.size(), thread_count, [&](std::size_t n) {
+                SharedPCH & pch = pchs[needed[n]];
+                pch.built = build_shared_pch(pch);
+                if (!pch.built) {
+                    llvm::errs() << "failed to precompile the include block of " << pch.command.Filename
+                                 << "; its " << pch.users << " users will parse it themselves\n";
+                }
+            });
+        }
+    }
+
+    std::unique_ptr<ResultCache> cache;
+    if (!CacheDir.empty() && !fused && !Supervise) {
+        // the options that change what is found
+        std::string options = std::string(AllDecls ? "all-decls" : "main-file") +
+            (SkipBodies ? ",skip-bodies" : "");
+        for (std::string const & path : scope.paths) {
+            options += "," + path;
+        }
+        cache = std::make_unique<ResultCache>(CacheDir, options);
+        if (!cache->good()) {
+            llvm::errs() << "cannot create cache directory " << CacheDir << "; continuing without\n";
+            cache.reset();
+        }
+    }
+
+    // Each source is parsed by its own ClangTool, on whichever worker claims it next, and
+    // its results kept separately; they are merged in source order afterwards so the
+    // report does not depend on the number of threads or how the work was scheduled.
+    std::vector<AnalysisResults> tu_results(sources.size());
+    std::vector<int>             tu_status(sources.size(), 0);
+    std::vector<double>          tu_ms(sources.size(), 0.0);
+    std::vector<SourceProfile>   tu_profile(ProfileMatchers ? sources.size() : 0);
+    std::vector<Stage1Output>    tu_stage1(fused ? sources.size() : 0);
+
+    // with --ndjson, each source's results are written out and dropped as soon as it is done
+    std::unique_ptr<NDJSONWriter> ndjson;
+    if (!NDJSONPath.empty()) {
+        ndjson = std::make_unique<NDJSONWriter>(NDJSONPath);
+        if (ndjson->error()) {
+            llvm::errs() << "cannot write " << NDJSONPath << ": " << ndjson->error().message() << "\n";
+            return 1;
+        }
+    }
+    auto finish_source = [&](std::size_t i) {
+        if (ndjson) {
+            ndjson->write(sources[i], tu_status[i], tu_ms[i], tu_results[i]);
+            // keeping only what --apply needs
+            AnalysisResults::replacement_map edits;
+            if (ApplyEdits) {
+                edits = std::move(tu_results[i].replacements);
+            }
+            tu_results[i] = AnalysisResults();
+            tu_results[i].replacements = std::move(edits);
+        }
+    };
+
+    auto process_source = [&](std::size_t i) {
+        ResultCache::Key key;
+        if (cache) {
+            key = cache->key(opt->getCompilations(), sources[i]);
+            if (!key.hash.empty() && cache->lookup(key, tu_results[i])) {
+                return;
+            }
+        }
+
+        // ClangTool changes into each command's directory through its file system, so
+        // give every one its own working directory
+        llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs(llvm::vfs::createPhysicalFileSystem().release());
+        std::shared_ptr<DependencyList> deps;
+        std::string blanked;    // with --pch, the source less its include block
+        auto analyze = [&](SharedPCH const * pch) {
+            LambdaAnalysis analysis(ProfileMatchers);
+            SourceProfile profile;
+            deps = key.hash.empty() ? nullptr : std::make_shared<DependencyList>();
+            ClangTool tool(opt->getCompilations(), {sources[i]},
+                           std::make_shared<PCHContainerOperations>(), fs);
+            if (fused && (tu_stage1[i].result == stage1_result::rewritten)) {
+                // parsed in place of the source, through ClangTool's in-memory overlay
+                llvm::SmallString<256> path(sources[i]);
+                llvm::sys::fs::make_absolute(path);
+                llvm::sys::path::remove_dots(path, true);
+                tool.mapVirtualFile(path, tu_stage1[i].text);
+            }
+            if (pch) {
+                llvm::SmallString<256> path(sources[i]);
+                llvm::sys::fs::make_absolute(path);
+                llvm::sys::path::remove_dots(path, true);
+                tool.mapVirtualFile(path, blanked);
+                tool.appendArgumentsAdjuster(
+                    getInsertArgumentAdjuster({"-include-pch", pch->pch_path}, ArgumentInsertPosition::BEGIN));
+            }
+            ScopedMatchActionFactory factory(analysis.finder(), scope, deps,
+                                             ProfileMatchers ? &profile.phases : nullptr);
+            std::int64_t start = PhaseTimes::now_ns();
+            tu_status[i] = tool.run(&factory);
+            tu_results[i] = std::move(analysis.results());
+            if (ProfileMatchers) {
+                profile.analyzed = true;
+                profile.total_ns = PhaseTimes::now_ns() - start;
+                for (auto const & record : analysis.matcher_times()) {
+                    profile.matcher_ms[record.getKey().str()] = record.getValue().getWallTime() * 1e3;
+                }
+                tu_profile[i] = std::move(profile);
+            }
+        };
+        SharedPCH const * pch = ((source_pch[i] >= 0) && pchs[source_pch[i]].built) ? &pchs[source_pch[i]] : nullptr;
+        llvm::sys::TimePoint<> parse_start = std::chrono::system_clock::now();
+        if (pch) {
+            blanked = blank_include_block(sources[i], pch->includes);
+            if (blanked.empty()) {
+                pch = nullptr;      // edited since the PCH was planned
+            }
+        }
+        analyze(pch);
+        if (pch && (tu_status[i] != 0)) {
+            // perhaps a header changed since the PCH was built
+            llvm::errs() << "retrying " << sources[i] << " without the shared PCH\n";
+            analyze(nullptr);
+        }
+        if (deps && (tu_status[i] == 0)) {
+            cache->store(key, deps->getDependencies(), pch_dir.str().str(), parse_start, tu_results[i]);
+        }
+    };
+
+    if (ndjson) {
+        ndjson->start(sources.size());
+    }
+    if (Supervise) {
+        if (!supervise(argv[0], worker_args(argc, argv), sources, Supervise, past_ms,
+                       tu_results, tu_status, tu_ms)) {
+            return 1;
+        }
+        for (std::size_t i = 0; i < sources.size(); ++i) {
+            finish_source(i);       // the workers' output, merged in source order
+        }
+    } else if (fused) {
+        // Stage 1 workers preprocess sources in order while stage 2 workers analyze those
+        // already done, so the two overlap; at most two sources per analysis thread are
+        // held in memory, waiting or being analyzed
+        Stage1Handoff handoff(sources.size(), 2 * thread_count);
+        std::vector<std::string> const macros(Stage1Macros.begin(), Stage1Macros.end());
+        auto preprocess = [&]() {
+            std::size_t i;
+            while (handoff.claim(i)) {
+                Stage1Output & out = tu_stage1[i];
+                llvm::SmallString<256> path(sources[i]);
+                llvm::sys::fs::make_absolute(path);
+                llvm::sys::path::remove_dots(path, true);
+                std::vector<CompileCommand> commands = opt->getCompilations().getCompileCommands(path);
+                if (commands.empty()) {
+                    out.errors = "no compile command for " + sources[i] + "\n";
+                } else {
+                    out.result = stage1_preprocess(commands.front().Filename, commands.front().Directory,
+                                                   commands.front().CommandLine, macros, out.text, out.errors);
+                }
+                handoff.publish(i);
+            }
+        };
+        unsigned stage1_count = Stage1Jobs ? Stage1Jobs.getValue() : std::max(1u, thread_count / 2);
+        std::vector<std::thread> stage1_pool;
+        for (unsigned t = 0; t < stage1_count; ++t) {
+            stage1_pool.emplace_back(preprocess);
+        }
+        for_each_parallel(thread_count, thread_count, [&](std::size_t) {
+            std::size_t i;
+            while (handoff.take(i)) {
+                Stage1Output & out = tu_stage1[i];
+                llvm::errs() << out.errors;
+                if (out.result == stage1_result::failed) {
+                    tu_status[i] = 1;
+                } else {
+                    std::int64_t start = PhaseTimes::now_ns();
+                    process_source(i);
+                    tu_ms[i] = (PhaseTimes::now_ns() - start) / 1e6;
+                }
+                finish_source(i);
+                std::string().swap(out.text);
+                handoff.release();
+            }
+        });
+        for (std::thread & t : stage1_pool) {
+            t.join();
+        }
+    } else {
+        for_each_parallel(sources.size(), thread_count, [&](std::size_t i) {
+            std::int64_t start = PhaseTimes::now_ns();
+            process_source(i);
+            tu_ms[i] = (PhaseTimes::now_ns() - start) / 1e6;
+            finish_source(i);
+        });
+    }
+
+    if (!pch_dir.empty()) {
+        llvm::sys::fs::remove_directories(pch_dir);
+    }
+    if (cache) {
+        llvm::errs() << "cache: " << cache->hits() << " hits, " << cache->misses() << " misses\n";
+    }
+    if (ProfileMatchers) {
+        report_profile(sources, tu_profile, ProfileJSON);
+    }
+
+    // as ClangTool reports for a group of files: 1 if any failed, else 2 if any were skipped
+    int result = 0;
+    for (int status : tu_status) {
+        if ((status == 1) || ((status == 2) && (result == 0))) {
+            result = status;
+        }
+    }
+    // a supervisor still reports what the others found after quarantining some sources
+    if (result && !Supervise) {
+        return result;
+    }
+
+    // every file's edits, checked against each other
+    AnalysisResults::replacement_map replacements;
+    for (AnalysisResults const & r : tu_results) {
+        for (auto const & rs : r.replacements) {
+            clang::tooling::Replacements & file_edits = replacements[rs.first];
+            for (auto const & edit : rs.second) {
+                // a header seen from two translation units produces the same edits twice
+                if (std::find(file_edits.begin(), file_edits.end(), edit) != file_edits.end()) {
+                    continue;
+                }
+                if (llvm::Error err = file_edits.add(edit)) {
+                    llvm::errs() << "dropping replacement " << edit.toString() << ": "
+                                 << llvm::toString(std::move(err)) << "\n";
+                }
+            }
+        }
+    }
+    if (ApplyEdits && result) {
+        llvm::errs() << "not applying edits: some sources failed\n";
+    } else if (ApplyEdits && !apply_replacements(replacements, thread_count)) {
+        return 1;
+    }
+    if (ndjson) {
+        return result;
+    }
+
+    // Lambdas are reported by name, as when one set of callbacks saw every translation unit:
+    // a later body replaces an earlier one, and uses accumulate
+    typedef std::pair<AnalysisResults const *, LambdaRecord const *> found_lambda;
+    std::map<llvm::StringRef, std::vector<found_lambda> > lambdas;
+    for (AnalysisResults const & r : tu_results) {
+        for (LambdaRecord const & lambda : r.lambdas) {
+            lambdas[lambda.name].emplace_back(&r, &lambda);
+        }
+    }
+
+    // report accumulated data
+    auto report_uses = [](std::vector<CaptureUse> const & uses, char const * title,
+                          std::initializer_list<CaptureUseKind> kinds) {
+        bool any = false;
+        for (CaptureUse const & use : uses) {
+            if (std::find(kinds.begin(), kinds.end(), use.kind) == kinds.end()) {
+                continue;
+            }
+            if (!any) {
+                std::cout << "    and " << title << " captures:\n";
+                any = true;
+            }
+            std::cout << "\t" << use.var.str() << " of type " << use.type.str() << "\n";
+        }
+    };
+    for (auto const & named : lambdas) {
+        std::cout << "lambda " << named.first.str() << " has body:\n"
+                  << named.second.back().second->body.str() << "\n";
+        std::vector<CaptureUse> uses;
+        for (found_lambda const & found : named.second) {
+            llvm::ArrayRef<CaptureUse> these = found.first->uses_of(*found.second);
+            uses.insert(uses.end(), these.begin(), these.end());
         }
-        
+        report_uses(uses, "lvalue ref", {CaptureUseKind::RefParam});
+        report_uses(uses, "assignment lhs", {CaptureUseKind::Assignment, CaptureUseKind::Increment});
     }
 
     std::cout << "Collected replacements:\n";
-    for (auto const & rs : tool.getReplacements()) {
+    for (auto const & rs : replacements) {
         std::cout << "in file " << rs.first << ":\n";
         for (auto const & r : rs.second) {
             std::cout << r.toString() << "\n";
         }
     }
 
-    return 0;
+    return result;
 }
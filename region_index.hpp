@@ -0,0 +1,527 @@
+/**
+ *   Copyright (C) 2015 Jeff Trull <edaskel@att.net>
+ *
+ *   Distributed under the Boost Software License, Version 1.0. (See accompanying
+ *   file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+ *
+ *
+ */
+
+// A persistent index of the conditional regions (#if/#ifdef/#ifndef/#elif/#else branches)
+// in a set of source files, answering "where is this macro tested, and in which branches"
+// without preprocessing anything.
+//
+// The index is a single file meant to be memory mapped and used in place:
+//
+//   index_header
+//   index_file[file_count]          sorted by path
+//   index_region[region_count]      grouped by file
+//   index_macro[macro_count]        sorted by name
+//   index_ref[ref_count]            grouped by macro
+//   char[string_bytes]              paths, macro names, condition text, and include lists
+//
+// Each file's modification time and size are recorded, so an update need only rescan the
+// files that changed.  So are its #include directives and the search paths they were
+// resolved with, so an update follows the includes of unchanged files just as a full
+// rebuild would, and can resolve those of a changed file it reaches without a compile job.
+
+#ifndef REGION_INDEX_HPP
+#define REGION_INDEX_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <boost/utility/string_ref.hpp>
+
+#include "directive_scanner.hpp"
+#include "mmap_iteration_policy.hpp"
+
+// how a region depends on a macro
+enum class region_polarity : std::uint32_t {
+    defined,      // entered only if it is defined (or true)
+    undefined,    // entered only if it is not
+    mixed         // it appears in some more complicated condition
+};
+
+inline char const * polarity_name(region_polarity p) {
+    switch (p) {
+    case region_polarity::defined:   return "defined";
+    case region_polarity::undefined: return "undefined";
+    default:                         return "mixed";
+    }
+}
+
+// a conditional region as found by scanning a file
+struct scanned_region {
+    std::uint32_t  begin_line;      // of the directive opening it
+    std::uint32_t  end_line;        // of the directive closing it (#elif, #else, #endif)
+    std::uint64_t  begin_offset;    // byte offsets of the start of those lines
+    std::uint64_t  end_offset;
+    std::uint32_t  depth;           // number of enclosing conditionals
+    directive_kind kind;            // of the opening directive
+    std::string    condition;       // its expression, if any
+    std::vector<std::pair<std::string, region_polarity> > macros;
+};
+
+// The macros a condition tests, and how
+// Simple tests of one macro (X, !X, defined X, !defined(X)) get a polarity; everything else
+// is "mixed"
+inline std::vector<std::pair<std::string, region_polarity> >
+condition_macros(directive_kind kind, boost::string_ref expr) {
+    auto is_ident_start = [](char c) {
+        return ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) || (c == '_');
+    };
+    auto is_ident_char = [&](char c) { return is_ident_start(c) || ((c >= '0') && (c <= '9')); };
+
+    std::vector<std::pair<std::string, region_polarity> > result;
+    if ((kind == directive_kind::ifdef) || (kind == directive_kind::ifndef)) {
+        std::size_t n = 0;
+        while ((n < expr.size()) && is_ident_char(expr[n])) {
+            ++n;
+        }
+        if (n) {
+            result.emplace_back(std::string(expr.data(), n),
+                                (kind == directive_kind::ifdef) ? region_polarity::defined
+                                                                : region_polarity::undefined);
+        }
+        return result;
+    }
+
+    // collect identifiers, skipping numbers (and their suffixes) and "defined" itself
+    std::vector<std::string> idents;
+    bool simple = true;      // only !, parentheses, "defined" and one identifier
+    bool negated = false;
+    for (std::size_t i = 0; i < expr.size(); ) {
+        char c = expr[i];
+        if (is_ident_start(c)) {
+            std::size_t start = i;
+            while ((i < expr.size()) && is_ident_char(expr[i])) {
+                ++i;
+            }
+            std::string ident(expr.data() + start, i - start);
+            if ((ident != "defined") && (ident != "true") && (ident != "false")) {
+                if (std::find(idents.begin(), idents.end(), ident) == idents.end()) {
+                    idents.push_back(ident);
+                }
+            }
+        } else if ((c >= '0') && (c <= '9')) {
+            simple = false;
+            while ((i < expr.size()) && (is_ident_char(expr[i]) || (expr[i] == '.'))) {
+                ++i;
+            }
+        } else {
+            if (c == '!') {
+                negated = !negated;
+            } else if ((c != ' ') && (c != '(') && (c != ')')) {
+                simple = false;
+            }
+            ++i;
+        }
+    }
+    simple = simple && (idents.size() == 1);
+    for (std::string & ident : idents) {
+        result.emplace_back(std::move(ident),
+                            !simple ? region_polarity::mixed
+                                    : (negated ? region_polarity::undefined : region_polarity::defined));
+    }
+    return result;
+}
+
+// Find the conditional regions of a file's text, and (optionally) what it includes,
+// as the text of each #include directive
+inline std::vector<scanned_region> scan_regions(char const * first, char const * last,
+                                                std::vector<std::string> * includes = nullptr) {
+    std::vector<scanned_region> regions;
+
+    // the branches so far of each open conditional, innermost last
+    struct open_conditional {
+        std::vector<std::pair<std::string, region_polarity> > earlier;   // tested by earlier branches
+        std::size_t current;                                             // index in regions
+    };
+    std::vector<open_conditional> open;
+
+    auto flip = [](region_polarity p) {
+        return (p == region_polarity::defined)   ? region_polarity::undefined
+             : (p == region_polarity::undefined) ? region_polarity::defined
+             :                                     region_polarity::mixed;
+    };
+    auto close_current = [&](directive const & d) {
+        scanned_region & r = regions[open.back().current];
+        r.end_line = std::uint32_t(d.line);
+        r.end_offset = d.begin - first;
+        // later branches are entered only if this one's condition failed
+        for (auto const & m : r.macros) {
+            auto & earlier = open.back().earlier;
+            auto it = std::find_if(earlier.begin(), earlier.end(),
+                                   [&m](std::pair<std::string, region_polarity> const & e) {
+                                       return e.first == m.first;
+                                   });
+            if (it == earlier.end()) {
+                earlier.emplace_back(m.first, flip(m.second));
+            } else if (it->second != flip(m.second)) {
+                it->second = region_polarity::mixed;
+            }
+        }
+    };
+    auto open_region = [&](directive const & d) {
+        scanned_region r;
+        r.begin_line = std::uint32_t(d.line);
+        r.end_line = r.begin_line;
+        r.begin_offset = d.begin - first;
+        r.end_offset = last - first;
+        r.depth = std::uint32_t(open.size() - 1);
+        r.kind = d.kind;
+        r.condition = d.args.to_string();
+        r.macros = condition_macros(d.kind, d.args);
+        // an #elif or #else depends on the earlier conditions too
+        for (auto const & e : open.back().earlier) {
+            if (std::none_of(r.macros.begin(), r.macros.end(),
+                             [&e](std::pair<std::string, region_polarity> const & m) {
+                                 return m.first == e.first;
+                             })) {
+                r.macros.push_back(e);
+            }
+        }
+        open.back().current = regions.size();
+        regions.push_back(std::move(r));
+    };
+
+    for_each_directive(first, last, [&](directive const & d) {
+        switch (d.kind) {
+        case directive_kind::if_:
+        case directive_kind::ifdef:
+        case directive_kind::ifndef:
+            open.push_back(open_conditional());
+            open_region(d);
+            break;
+
+        case directive_kind::elif:
+        case directive_kind::else_:
+            if (!open.empty()) {
+                close_current(d);
+                open_region(d);
+            }
+            break;
+
+        case directive_kind::endif:
+            if (!open.empty()) {
+                close_current(d);
+                open.pop_back();
+            }
+            break;
+
+        case directive_kind::include:
+            if (includes) {
+                includes->push_back(d.args.to_string());
+            }
+            break;
+
+        default:
+            break;
+        }
+        return true;
+    });
+    return regions;
+}
+
+// on-disk records, all naturally aligned with no padding
+struct index_header {
+    char          magic[8];
+    std::uint32_t version;
+    std::uint32_t file_count;
+    std::uint32_t region_count;
+    std::uint32_t macro_count;
+    std::uint32_t ref_count;
+    std::uint32_t reserved;
+    std::uint64_t string_bytes;
+};
+
+struct index_file {
+    std::int64_t  mtime_ns;
+    std::int64_t  size;
+    std::uint32_t path;          // offset and length in the string table
+    std::uint32_t path_len;
+    std::uint32_t first_region;
+    std::uint32_t region_count;
+    std::uint32_t includes;      // the text of its #includes, one per line, in the string table
+    std::uint32_t includes_len;
+    std::uint32_t search;        // the search paths for them, as the indexer encodes them
+    std::uint32_t search_len;
+};
+
+struct index_region {
+    std::uint64_t begin_offset;
+    std::uint64_t end_offset;
+    std::uint32_t file;
+    std::uint32_t begin_line;
+    std::uint32_t end_line;
+    std::uint32_t depth;
+    std::uint32_t kind;          // directive_kind
+    std::uint32_t condition;     // offset and length in the string table
+    std::uint32_t condition_len;
+    std::uint32_t reserved;
+};
+
+struct index_macro {
+    std::uint32_t name;          // offset and length in the string table
+    std::uint32_t name_len;
+    std::uint32_t first_ref;
+    std::uint32_t ref_count;
+};
+
+struct index_ref {
+    std::uint32_t region;
+    std::uint32_t polarity;      // region_polarity
+};
+
+static_assert(sizeof(index_header) == 40, "index layout");
+static_assert(sizeof(index_file) == 48, "index layout");
+static_assert(sizeof(index_region) == 48, "index layout");
+
+char const region_index_magic[8] = {'R', 'S', '1', 'I', 'N', 'D', 'E', 'X'};
+std::uint32_t const region_index_version = 2;
+
+// modification time and size, to tell whether a file has changed since it was indexed
+struct file_version {
+    std::int64_t mtime_ns = -1;
+    std::int64_t size = -1;
+    bool operator==(file_version const & other) const {
+        return (mtime_ns == other.mtime_ns) && (size == other.size);
+    }
+};
+
+inline file_version version_of(std::string const & path) {
+    file_version v;
+    struct stat st;
+    if (::stat(path.c_str(), &st) == 0) {
+        v.mtime_ns = std::int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        v.size = st.st_size;
+    }
+    return v;
+}
+
+// A read-only view of an index file
+class region_index {
+public:
+    // returns false if the file is missing or not an index of this version
+    bool open(std::string const & path) {
+        if (!m_mapping.open(path.c_str()) || (m_mapping.size() < sizeof(index_header))) {
+            return false;
+        }
+        m_header = reinterpret_cast<index_header const *>(m_mapping.begin());
+        if ((std::memcmp(m_header->magic, region_index_magic, sizeof(region_index_magic)) != 0) ||
+            (m_header->version != region_index_version)) {
+            return false;
+        }
+        char const * p = m_mapping.begin() + sizeof(index_header);
+        m_files   = reinterpret_cast<index_file const *>(p);
+        p += m_header->file_count * sizeof(index_file);
+        m_regions = reinterpret_cast<index_region const *>(p);
+        p += m_header->region_count * sizeof(index_region);
+        m_macros  = reinterpret_cast<index_macro const *>(p);
+        p += m_header->macro_count * sizeof(index_macro);
+        m_refs    = reinterpret_cast<index_ref const *>(p);
+        p += m_header->ref_count * sizeof(index_ref);
+        m_strings = p;
+        return std::size_t(p - m_mapping.begin()) + m_header->string_bytes == m_mapping.size();
+    }
+
+    std::uint32_t file_count() const   { return m_header->file_count; }
+    std::uint32_t region_count() const { return m_header->region_count; }
+    std::uint32_t macro_count() const  { return m_header->macro_count; }
+
+    index_file const &   file(std::uint32_t i) const   { return m_files[i]; }
+    index_region const & region(std::uint32_t i) const { return m_regions[i]; }
+
+    boost::string_ref file_path(std::uint32_t i) const {
+        return string(m_files[i].path, m_files[i].path_len);
+    }
+    boost::string_ref file_includes(std::uint32_t i) const {
+        return string(m_files[i].includes, m_files[i].includes_len);
+    }
+    boost::string_ref file_search(std::uint32_t i) const {
+        return string(m_files[i].search, m_files[i].search_len);
+    }
+    boost::string_ref condition(index_region const & r) const {
+        return string(r.condition, r.condition_len);
+    }
+    boost::string_ref macro_name(std::uint32_t i) const {
+        return string(m_macros[i].name, m_macros[i].name_len);
+    }
+
+    // the references to a macro, found by binary search
+    std::pair<index_ref const *, index_ref const *> uses(boost::string_ref name) const {
+        index_macro const * first = m_macros;
+        index_macro const * last  = m_macros + m_header->macro_count;
+        index_macro const * it = std::lower_bound(first, last, name,
+            [this](index_macro const & m, boost::string_ref n) {
+                return string(m.name, m.name_len) < n;
+            });
+        if ((it == last) || (string(it->name, it->name_len) != name)) {
+            return std::make_pair(m_refs, m_refs);
+        }
+        return std::make_pair(m_refs + it->first_ref, m_refs + it->first_ref + it->ref_count);
+    }
+
+    // the index of the named file, or file_count()
+    std::uint32_t find_file(boost::string_ref path) const {
+        index_file const * first = m_files;
+        index_file const * last  = m_files + m_header->file_count;
+        index_file const * it = std::lower_bound(first, last, path,
+            [this](index_file const & f, boost::string_ref p) {
+                return string(f.path, f.path_len) < p;
+            });
+        if ((it == last) || (string(it->path, it->path_len) != path)) {
+            return m_header->file_count;
+        }
+        return std::uint32_t(it - first);
+    }
+
+    // the regions of one file as they were scanned, for carrying over to a new index
+    std::vector<scanned_region> file_regions(std::uint32_t f) const {
+        // references are stored by macro, so gather them by region first
+        if (m_region_macros.empty()) {
+            m_region_macros.resize(m_header->region_count);
+            for (std::uint32_t m = 0; m < m_header->macro_count; ++m) {
+                for (std::uint32_t i = 0; i < m_macros[m].ref_count; ++i) {
+                    index_ref const & ref = m_refs[m_macros[m].first_ref + i];
+                    m_region_macros[ref.region].emplace_back(
+                        macro_name(m).to_string(), region_polarity(ref.polarity));
+                }
+            }
+        }
+        std::vector<scanned_region> result;
+        for (std::uint32_t i = 0; i < m_files[f].region_count; ++i) {
+            std::uint32_t ri = m_files[f].first_region + i;
+            index_region const & r = m_regions[ri];
+            result.push_back(scanned_region{r.begin_line, r.end_line, r.begin_offset, r.end_offset,
+                                            r.depth, directive_kind(r.kind),
+                                            condition(r).to_string(), m_region_macros[ri]});
+        }
+        return result;
+    }
+
+private:
+    boost::string_ref string(std::uint32_t offset, std::uint32_t len) const {
+        return boost::string_ref(m_strings + offset, len);
+    }
+
+    mapped_file                  m_mapping;
+    index_header const *         m_header = nullptr;
+    index_file const *           m_files = nullptr;
+    index_region const *         m_regions = nullptr;
+    index_macro const *          m_macros = nullptr;
+    index_ref const *            m_refs = nullptr;
+    char const *                 m_strings = nullptr;
+    mutable std::vector<std::vector<std::pair<std::string, region_polarity> > > m_region_macros;
+};
+
+// Accumulates files and their regions, then writes them out as an index
+class region_index_builder {
+public:
+    // includes: the text of its #include directives, one per line; search: the paths they
+    // are resolved with (opaque here)
+    void add_file(std::string path, file_version ver, std::vector<scanned_region> regions,
+                  std::string includes, std::string search) {
+        m_files[std::move(path)] = entry{ver, std::move(regions), std::move(includes), std::move(search)};
+    }
+
+    std::size_t file_count() const { return m_files.size(); }
+
+    // write to a temporary file and rename it into place, so readers never see a partial index
+    bool write(std::string const & path) const {
+        std::string strings;
+        auto add_string = [&strings](std::string const & s) {
+            std::uint32_t offset = std::uint32_t(strings.size());
+            strings += s;
+            return offset;
+        };
+        // search paths are mostly the same from file to file, so each is stored once
+        std::map<std::string, std::uint32_t> shared;
+        auto add_shared_string = [&](std::string const & s) {
+            auto it = shared.find(s);
+            if (it == shared.end()) {
+                it = shared.emplace(s, add_string(s)).first;
+            }
+            return it->second;
+        };
+
+        std::vector<index_file>   files;
+        std::vector<index_region> regions;
+        std::map<std::string, std::vector<index_ref> > refs;    // sorted by macro name
+        for (auto const & f : m_files) {         // a std::map, so already sorted by path
+            index_file file{f.second.ver.mtime_ns, f.second.ver.size,
+                            add_string(f.first), std::uint32_t(f.first.size()),
+                            std::uint32_t(regions.size()), std::uint32_t(f.second.regions.size()),
+                            add_string(f.second.includes), std::uint32_t(f.second.includes.size()),
+                            add_shared_string(f.second.search), std::uint32_t(f.second.search.size())};
+            for (scanned_region const & r : f.second.regions) {
+                std::uint32_t ri = std::uint32_t(regions.size());
+                regions.push_back(index_region{r.begin_offset, r.end_offset,
+                                               std::uint32_t(files.size()),
+                                               r.begin_line, r.end_line, r.depth,
+                                               std::uint32_t(r.kind),
+                                               add_string(r.condition),
+                                               std::uint32_t(r.condition.size()), 0});
+                for (auto const & m : r.macros) {
+                    refs[m.first].push_back(index_ref{ri, std::uint32_t(m.second)});
+                }
+            }
+            files.push_back(file);
+        }
+
+        std::vector<index_macro> macros;
+        std::vector<index_ref>   all_refs;
+        for (auto const & m : refs) {
+            macros.push_back(index_macro{add_string(m.first), std::uint32_t(m.first.size()),
+                                         std::uint32_t(all_refs.size()), std::uint32_t(m.second.size())});
+            all_refs.insert(all_refs.end(), m.second.begin(), m.second.end());
+        }
+
+        index_header header;
+        std::memcpy(header.magic, region_index_magic, sizeof(header.magic));
+        header.version      = region_index_version;
+        header.file_count   = std::uint32_t(files.size());
+        header.region_count = std::uint32_t(regions.size());
+        header.macro_count  = std::uint32_t(macros.size());
+        header.ref_count    = std::uint32_t(all_refs.size());
+        header.reserved     = 0;
+        header.string_bytes = strings.size();
+
+        std::string tmp = path + ".tmp";
+        std::FILE * out = std::fopen(tmp.c_str(), "wb");
+        if (!out) {
+            return false;
+        }
+        bool ok = (std::fwrite(&header, sizeof(header), 1, out) == 1);
+        auto put = [&](void const * data, std::size_t n) {
+            ok = ok && ((n == 0) || (std::fwrite(data, n, 1, out) == 1));
+        };
+        put(files.data(),    files.size() * sizeof(index_file));
+        put(regions.data(),  regions.size() * sizeof(index_region));
+        put(macros.data(),   macros.size() * sizeof(index_macro));
+        put(all_refs.data(), all_refs.size() * sizeof(index_ref));
+        put(strings.data(),  strings.size());
+        ok = (std::fclose(out) == 0) && ok;
+        return ok && (std::rename(tmp.c_str(), path.c_str()) == 0);
+    }
+
+private:
+    struct entry {
+        file_version                ver;
+        std::vector<scanned_region> regions;
+        std::string                 includes;
+        std::string                 search;
+    };
+    std::map<std::string, entry> m_files;
+};
+
+#endif // REGION_INDEX_HPP
@@ -0,0 +1,44 @@
+#
+#    Copyright (C) 2015 Jeff Trull <edaskel@att.net>
+#
+#    Distributed under the Boost Software License, Version 1.0. (See accompanying
+#    file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+#
+#
+
+# An index updated after a header changes must be the same as one built from scratch
+# Here an unchanged source includes a header that gains an #include found only through the
+# source's -I path.
+#
+# usage: cmake -DRS1=<path to rs1> -DWORK=<scratch directory> -P region_index_test.cmake
+
+file( REMOVE_RECURSE ${WORK} )
+file( WRITE ${WORK}/src/main.cpp "#include \"a.hpp\"\nint main() {}\n" )
+file( WRITE ${WORK}/src/a.hpp "#pragma once\n" )
+file( WRITE ${WORK}/inc/b.hpp "#ifdef FOO\nint b;\n#endif\n" )
+file( WRITE ${WORK}/compile_commands.json
+  "[{\"directory\": \"${WORK}\", \"command\": \"c++ -Iinc -c src/main.cpp\", \"file\": \"src/main.cpp\"}]\n" )
+
+function( rs1 )
+  execute_process( COMMAND ${RS1} ${ARGN} WORKING_DIRECTORY ${WORK}
+                   RESULT_VARIABLE status OUTPUT_VARIABLE out ERROR_VARIABLE out )
+  if( NOT status EQUAL 0 )
+    message( FATAL_ERROR "rs1 ${ARGN} failed:\n${out}" )
+  endif()
+  set( rs1_output "${out}" PARENT_SCOPE )
+endfunction()
+
+rs1( -p . --index updated.idx )
+file( WRITE ${WORK}/src/a.hpp "#pragma once\n#include \"b.hpp\"\n" )
+rs1( -p . --index updated.idx )
+rs1( -p . --index rebuilt.idx )
+
+file( SHA256 ${WORK}/updated.idx updated )
+file( SHA256 ${WORK}/rebuilt.idx rebuilt )
+if( NOT updated STREQUAL rebuilt )
+  message( FATAL_ERROR "the updated index differs from a full rebuild" )
+endif()
+rs1( --index updated.idx --query FOO )
+if( NOT rs1_output MATCHES "inc/b.hpp:1-3" )
+  message( FATAL_ERROR "the update missed inc/b.hpp:\n${rs1_output}" )
+endif()
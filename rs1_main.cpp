@@ -0,0 +1,16 @@
+/**
+ *   Copyright (C) 2015 Jeff Trull <edaskel@att.net>
+ *
+ *   Distributed under the Boost Software License, Version 1.0. (See accompanying
+ *   file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+ *
+ *
+ */
+
+// rs1: stage 1 from the command line (the work is all in the stage1 library)
+
+#include "stage1.hpp"
+
+int main(int argc, char const **argv) {
+    return stage1_main(argc, argv);
+}
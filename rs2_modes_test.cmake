@@ -0,0 +1,77 @@
+#
+#    Copyright (C) 2015 Jeff Trull <edaskel@att.net>
+#
+#    Distributed under the Boost Software License, Version 1.0. (See accompanying
+#    file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+#
+#
+
+# Every way of running rs2 must report the same lambdas, capture uses and replacements as a
+# plain single threaded run: -j, --skip-bodies, --pch, --cache (empty, then full),
+# --stage1-macro (on sources without hunks, which stage 1 leaves alone) and --supervise.
+# Records are compared sorted, without the "run" record or run times.
+#
+# usage: cmake -DRS2=<path to rs2> -DCXX=<compiler> -DSOURCES=<source;source...>
+#              -DWORK=<scratch directory> -P rs2_modes_test.cmake
+
+file( REMOVE_RECURSE ${WORK} )
+file( MAKE_DIRECTORY ${WORK} )
+set( commands "" )
+set( names "" )
+foreach( source ${SOURCES} )
+  get_filename_component( name ${source} NAME )
+  configure_file( ${source} ${WORK}/${name} COPYONLY )
+  if( commands )
+    set( commands "${commands},\n" )
+  endif()
+  set( commands "${commands} {\"directory\": \"${WORK}\", \"command\": \"${CXX} -std=c++14 -c ${name}\", \"file\": \"${name}\"}" )
+  list( APPEND names ${name} )
+endforeach()
+file( WRITE ${WORK}/compile_commands.json "[\n${commands}\n]\n" )
+
+# run rs2 with these options, leaving its records, normalized, in <label>_records
+function( rs2 label )
+  execute_process( COMMAND ${RS2} -p ${WORK} --ndjson ${label}.ndjson ${ARGN} ${names}
+                   WORKING_DIRECTORY ${WORK}
+                   RESULT_VARIABLE status OUTPUT_VARIABLE out ERROR_VARIABLE out )
+  string( REPLACE ";" " " options "${ARGN}" )
+  if( NOT status EQUAL 0 )
+    message( FATAL_ERROR "rs2 ${options} failed:\n${out}" )
+  endif()
+  # one line per list element; the lambda bodies' semicolons mustn't split them further
+  file( READ ${WORK}/${label}.ndjson text )
+  string( REPLACE ";" "<semicolon>" text "${text}" )
+  string( REGEX REPLACE "\n$" "" text "${text}" )
+  string( REPLACE "\n" ";" lines "${text}" )
+  set( records "" )
+  foreach( line ${lines} )
+    if( NOT line MATCHES "\"record\":\"run\"" )
+      string( REGEX REPLACE "\"ms\":[^,}]*,?" "" line "${line}" )
+      list( APPEND records "${line}" )
+    endif()
+  endforeach()
+  list( SORT records )
+  set( ${label}_records "${records}" PARENT_SCOPE )
+endfunction()
+
+rs2( plain -j 1 )
+if( NOT plain_records MATCHES "expression_capture_0" )
+  message( FATAL_ERROR "rs2 found no lambdas:\n${plain_records}" )
+endif()
+
+function( check label )
+  rs2( ${label} ${ARGN} )
+  if( NOT ${label}_records STREQUAL plain_records )
+    string( REPLACE ";" "\n" got "${${label}_records}" )
+    string( REPLACE ";" "\n" expected "${plain_records}" )
+    message( FATAL_ERROR "${label} reported\n${got}\ninstead of\n${expected}" )
+  endif()
+endfunction()
+
+check( threads -j 4 )
+check( skip_bodies --skip-bodies )
+check( pch --pch )
+check( cache_cold --cache ${WORK}/cache )
+check( cache_warm --cache ${WORK}/cache )
+check( stage1 --stage1-macro TEST_PP_CONDITIONAL )
+check( supervise --supervise 2 )
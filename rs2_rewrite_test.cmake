@@ -0,0 +1,68 @@
+#
+#    Copyright (C) 2015 Jeff Trull <edaskel@att.net>
+#
+#    Distributed under the Boost Software License, Version 1.0. (See accompanying
+#    file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+#
+#
+# Lambdas rewritten by rs2 --apply must still compile and behave the same.  The ones that
+# change a capture must take it by reference, the ones that only read it by const reference,
+# and the lambdas it can't rewrite (mutable, with init-captures, in templates, or capturing
+# something whose type can't be written) must be left as they were.
+#
+# usage: cmake -DRS2=<path to rs2> -DCXX=<compiler> -DSOURCE=<rs2_rewrite_test.cpp>
+#              -DWORK=<scratch directory> -P rs2_rewrite_test.cmake
+
+file( REMOVE_RECURSE ${WORK} )
+file( MAKE_DIRECTORY ${WORK} )
+configure_file( ${SOURCE} ${WORK}/original.cpp COPYONLY )
+configure_file( ${SOURCE} ${WORK}/rewritten.cpp COPYONLY )
+
+function( run name )
+  execute_process( COMMAND ${ARGN} WORKING_DIRECTORY ${WORK}
+                   RESULT_VARIABLE status OUTPUT_VARIABLE out ERROR_VARIABLE err )
+  if( NOT status EQUAL 0 )
+    message( FATAL_ERROR "${name} failed:\n${out}${err}" )
+  endif()
+  set( ${name}_output "${out}" PARENT_SCOPE )
+endfunction()
+
+# what rs2 reports of the original: a member operator's object is not its first argument
+run( rs2_report ${RS2} --ndjson uses.ndjson original.cpp -- -std=c++14 )
+file( STRINGS ${WORK}/uses.ndjson call_record REGEX "expression_capture_7\"" )
+if( NOT call_record MATCHES "\"use\":\"ref_param\",\"var\":\"r\"" OR
+    call_record MATCHES "\"use\":\"ref_param\",\"var\":\"add\"" )
+  message( FATAL_ERROR "wrong uses reported for add(r):\n${call_record}" )
+endif()
+
+run( rs2 ${RS2} --apply rewritten.cpp -- -std=c++14 )
+file( READ ${WORK}/rewritten.cpp rewritten )
+
+# the line declaring expression_capture_<n> must match one regex and not the other
+function( check n match nomatch )
+  string( REGEX MATCH "expression_capture_${n} =[^\n]*" line "${rewritten}" )
+  if( NOT line MATCHES "${match}" OR line MATCHES "${nomatch}" )
+    message( FATAL_ERROR "expression_capture_${n} was rewritten wrongly:\n${line}" )
+  endif()
+endfunction()
+
+check( 0 "const[^,]*& ?str.*const[^,]*& ?a.*const[^,]*& ?b" "^$" )
+check( 1 "\\[\\]\\(.*& ?g\\)" "const" )
+check( 2 "\\[\\]\\(.*& ?str\\)" "const" )
+check( 3 "\\[\\]\\(.*& ?p\\)" "const" )
+check( 4 "\\[\\]\\(.*& ?q\\)" "const int & ?q|int const & ?q" )
+check( 5 "\\[m\\]\\(\\) mutable" "^$" )
+check( 6 "\\[n = a\\]\\(\\)" "^$" )
+check( 7 "const[^,]*& ?add" "const int & ?r|int const & ?r" )
+foreach( n 8 9 10 11 )
+  check( ${n} "\\[&\\]\\(\\)" "^$" )
+endforeach()
+
+run( compile_original ${CXX} -std=c++14 -o original original.cpp )
+run( compile_rewritten ${CXX} -std=c++14 -o rewritten rewritten.cpp )
+run( original ${WORK}/original )
+run( rewritten ${WORK}/rewritten )
+if( NOT original_output STREQUAL rewritten_output )
+  message( FATAL_ERROR "the rewritten program behaves differently:\n"
+           "${original_output}\nbecame\n${rewritten_output}" )
+endif()
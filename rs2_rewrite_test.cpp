@@ -0,0 +1,130 @@
+// Input for the rs2 rewrite test (rs2_rewrite_test.cmake)
+// Each lambda uses its captures in a way the rewritten function must still compile and behave
+// the same for; the program's output is compared before and after --apply.
+
+#include <iostream>
+#include <string>
+
+void set_through(int * p) {
+    *p = 7;
+}
+
+void add_one(int & v) {
+    ++v;
+}
+
+// a function object whose call operator changes its argument, not itself
+struct Adder {
+    void operator()(int & v) const {
+        ++v;
+    }
+};
+
+// in a template the types of the captures depend on the instantiation, so this is left alone
+template <typename T>
+T twice(T v) {
+    auto expression_capture_8 = [&]() -> void {
+        v += v;
+    };
+    expression_capture_8();
+    return v;
+}
+
+int main() {
+    std::string str("read only");
+    int         a = 100, b = 100, c = 0xff, d = 1, e = 17, g = 256;
+
+    // only read: str, a and b become const references
+    auto expression_capture_0 = [&]() -> void {
+        std::cout << str << " " << str.size() << " " << a + b << "\n";
+    };
+    expression_capture_0();
+
+    // each compound assignment changes its variable
+    auto expression_capture_1 = [&]() -> void {
+        a *= 3;
+        b /= 7;
+        c ^= 0x0f;
+        d <<= 4;
+        e %= 5;
+        g >>= 2;
+    };
+    expression_capture_1();
+    std::cout << a << " " << b << " " << c << " " << d << " " << e << " " << g << "\n";
+
+    // a non-const member function changes str
+    auto expression_capture_2 = [&]() -> void {
+        str.append(", then appended");
+    };
+    expression_capture_2();
+    std::cout << str << "\n";
+
+    // so does passing its address to a function taking a pointer
+    int p = 0;
+    auto expression_capture_3 = [&]() -> void {
+        set_through(&p);
+    };
+    expression_capture_3();
+    std::cout << p << "\n";
+
+    // and a call through a function pointer, whose parameter the tool can't see
+    void (*fp)(int &) = add_one;
+    int q = 0;
+    auto expression_capture_4 = [&]() -> void {
+        fp(q);
+    };
+    expression_capture_4();
+    std::cout << q << "\n";
+
+    // a mutable lambda has its own copy of m, and must be left alone
+    int m = 5;
+    auto expression_capture_5 = [m]() mutable -> void {
+        m += 1;
+        std::cout << m << "\n";
+    };
+    expression_capture_5();
+    expression_capture_5();
+    std::cout << m << "\n";
+
+    // as must one with an init-capture
+    auto expression_capture_6 = [n = a]() -> void {
+        std::cout << n << "\n";
+    };
+    a = 0;
+    expression_capture_6();
+
+    // calling a member operator: the object comes before the operator's arguments, so it is
+    // r the call changes, not add
+    Adder add;
+    int r = 1;
+    auto expression_capture_7 = [&]() -> void {
+        add(r);
+    };
+    expression_capture_7();
+    std::cout << r << "\n";
+
+    std::cout << twice(21) << " " << twice(1.25) << "\n";
+
+    // lambdas capturing something whose type can't be written are left alone: a closure,
+    auto doubled = [&]() { return 2 * r; };
+    auto expression_capture_9 = [&]() -> void {
+        std::cout << doubled() << "\n";
+    };
+    expression_capture_9();
+
+    // an unnamed struct,
+    struct { int x = 3; } unnamed;
+    auto expression_capture_10 = [&]() -> void {
+        unnamed.x *= 2;
+    };
+    expression_capture_10();
+    std::cout << unnamed.x << "\n";
+
+    // or a local class
+    struct Local { int y = 4; } local;
+    auto expression_capture_11 = [&]() -> void {
+        local.y += 1;
+    };
+    expression_capture_11();
+    std::cout << local.y << "\n";
+}
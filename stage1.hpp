@@ -0,0 +1,41 @@
+/**
+ *   Copyright (C) 2015 Jeff Trull <edaskel@att.net>
+ *
+ *   Distributed under the Boost Software License, Version 1.0. (See accompanying
+ *   file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+ *
+ *
+ */
+
+// Stage 1 as a library, for rs1 and for a driver that hands its output straight to stage 2
+// Only standard types appear here: the implementation (refactor_stage1.cpp) needs Boost and
+// exceptions, which its callers may not have.
+
+#ifndef STAGE1_HPP
+#define STAGE1_HPP
+
+#include <string>
+#include <vector>
+
+enum class stage1_result {
+    unchanged,     // the file cannot contain a hunk, so it needs no rewriting
+    rewritten,     // text holds the rewritten translation unit
+    failed         // errors says why
+};
+
+// Preprocess one translation unit from a compilation database entry (its file, directory,
+// and arguments, the first being the compiler) into text, turning the conditionals on
+// macros into lambdas named expression_capture_N that stage 2 can compile and analyze.
+// Safe to call from several threads at once.
+stage1_result stage1_preprocess(std::string const & file,
+                                std::string const & directory,
+                                std::vector<std::string> const & args,
+                                std::vector<std::string> const & macros,
+                                std::string & text,
+                                std::string & errors);
+
+// The rs1 command line: its options, batch mode, the region index, and the built-in
+// examples.  Returns the exit status.
+int stage1_main(int argc, char const ** argv);
+
+#endif // STAGE1_HPP
@@ -0,0 +1,216 @@
+/**
+ *   Copyright (C) 2015 Jeff Trull <edaskel@att.net>
+ *
+ *   Distributed under the Boost Software License, Version 1.0. (See accompanying
+ *   file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+ *
+ *
+ */
+
+// Optional instrumentation for stage 1: time and counts per file, as seen by the
+// preprocessing hooks, written out in the Chrome trace event format (which Perfetto and
+// chrome://tracing display) and summarized as a table of the most expensive files.
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "output_sink.hpp"    // for append_json_string
+
+// one file's stay on the include stack
+struct trace_span {
+    std::string   file;
+    std::int64_t  begin_ns;       // from the start of the run
+    std::int64_t  end_ns;
+    std::int64_t  child_ns;       // spent in files it included
+    std::size_t   depth;          // 0 for the main file
+    std::size_t   tokens;         // produced while it was the current file
+    std::size_t   skipped;        // tokens skipped (in false conditionals, and directives)
+    std::size_t   fsm_events;     // state machine events dispatched
+};
+
+// Collects the spans of every translation unit in a run, from any thread
+class trace_log {
+public:
+    // nanoseconds since the log was created, for timestamps
+    std::int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - m_epoch).count();
+    }
+
+    void add(std::vector<trace_span> const & spans) {
+        std::size_t tid = thread_id();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (trace_span const & span : spans) {
+            m_spans.push_back(std::make_pair(tid, span));
+        }
+    }
+
+    // all spans as "complete" events, one track per worker thread
+    bool write_chrome_trace(std::string const & path) const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        buffered_writer out(path);
+        out.write(std::string("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"));
+        std::string ev;
+        bool first = true;
+        for (auto const & entry : m_spans) {
+            trace_span const & s = entry.second;
+            ev = first ? "{\"name\":" : ",\n{\"name\":";
+            first = false;
+            append_json_string(ev, s.file);
+            char buf[256];
+            std::snprintf(buf, sizeof(buf),
+                          ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,"
+                          "\"args\":{\"depth\":%zu,\"tokens\":%zu,\"skipped\":%zu,\"fsm_events\":%zu,"
+                          "\"self_us\":%.3f}}",
+                          s.depth ? "include" : "source", entry.first,
+                          s.begin_ns / 1e3, (s.end_ns - s.begin_ns) / 1e3,
+                          s.depth, s.tokens, s.skipped, s.fsm_events,
+                          (s.end_ns - s.begin_ns - s.child_ns) / 1e3);
+            ev += buf;
+            out.write(ev);
+        }
+        out.write(std::string("\n]}\n"));
+        out.flush();
+        return out.good();
+    }
+
+    // per-file totals over the whole run, most expensive (by self time) first
+    void write_summary(std::ostream & os, std::size_t limit) const {
+        struct totals {
+            std::int64_t self_ns = 0;
+            std::int64_t total_ns = 0;
+            std::size_t  opens = 0;
+            std::size_t  tokens = 0;
+            std::size_t  skipped = 0;
+            std::size_t  fsm_events = 0;
+        };
+        std::map<std::string, totals> files;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto const & entry : m_spans) {
+                trace_span const & s = entry.second;
+                totals & t = files[s.file];
+                t.self_ns    += s.end_ns - s.begin_ns - s.child_ns;
+                t.total_ns   += s.end_ns - s.begin_ns;
+                t.opens++;
+                t.tokens     += s.tokens;
+                t.skipped    += s.skipped;
+                t.fsm_events += s.fsm_events;
+            }
+        }
+        std::vector<std::pair<std::string, totals> > sorted(files.begin(), files.end());
+        std::sort(sorted.begin(), sorted.end(),
+                  [](std::pair<std::string, totals> const & a, std::pair<std::string, totals> const & b) {
+                      return a.second.self_ns > b.second.self_ns;
+                  });
+
+        os << "trace: " << sorted.size() << " files";
+        if (sorted.size() > limit) {
+            os << ", top " << limit << " by self time";
+        }
+        os << "\n";
+        char line[128];
+        std::snprintf(line, sizeof(line), "%10s %10s %6s %10s %10s %8s  %s\n",
+                      "self ms", "total ms", "opens", "tokens", "skipped", "fsm", "file");
+        os << line;
+        for (std::size_t i = 0; (i < sorted.size()) && (i < limit); ++i) {
+            totals const & t = sorted[i].second;
+            std::snprintf(line, sizeof(line), "%10.2f %10.2f %6zu %10zu %10zu %8zu  ",
+                          t.self_ns / 1e6, t.total_ns / 1e6, t.opens, t.tokens, t.skipped, t.fsm_events);
+            os << line << sorted[i].first << "\n";
+        }
+    }
+
+private:
+    // small integers for the worker threads, which become trace "tid"s
+    std::size_t thread_id() {
+        thread_local std::size_t id = m_next_thread++;
+        return id;
+    }
+
+    std::chrono::steady_clock::time_point                m_epoch = std::chrono::steady_clock::now();
+    mutable std::mutex                                   m_mutex;
+    std::vector<std::pair<std::size_t, trace_span> >     m_spans;    // with the recording thread
+    std::atomic<std::size_t>                             m_next_thread{1};
+};
+
+// The spans for one translation unit, recorded by its preprocessing hooks
+// Not thread safe: each context has its own, and hands its spans to the trace_log when done.
+class tu_trace {
+public:
+    // start timing the main file
+    tu_trace(trace_log & log, std::string const & main_file)
+        : m_log(log), m_include_start(log.now()) {
+        push(main_file, m_include_start);
+    }
+
+    // An #include directive was found; the file, if opened, is timed from here so that
+    // locating and loading it count too
+    void include_found() { m_include_start = m_log.now(); }
+
+    // fsm_events: the running total for this translation unit
+    void file_opened(std::string const & path, std::size_t fsm_events) {
+        charge(fsm_events);
+        push(path, m_include_start);
+    }
+
+    void file_closed(std::size_t fsm_events) {
+        charge(fsm_events);
+        pop(m_log.now());
+    }
+
+    // close anything still open (normally just the main file) and hand the spans to the log
+    void finish(std::size_t fsm_events) {
+        charge(fsm_events);
+        std::int64_t now = m_log.now();
+        while (!m_open.empty()) {
+            pop(now);
+        }
+        m_log.add(m_spans);
+    }
+
+    void token()         { if (!m_open.empty()) { m_spans[m_open.back()].tokens++; } }
+    void skipped_token() { if (!m_open.empty()) { m_spans[m_open.back()].skipped++; } }
+
+private:
+    void push(std::string const & path, std::int64_t start_ns) {
+        m_open.push_back(m_spans.size());
+        m_spans.push_back(trace_span{path, start_ns, start_ns, 0, m_open.size() - 1, 0, 0, 0});
+    }
+
+    void pop(std::int64_t now_ns) {
+        trace_span & span = m_spans[m_open.back()];
+        span.end_ns = now_ns;
+        m_open.pop_back();
+        if (!m_open.empty()) {
+            m_spans[m_open.back()].child_ns += span.end_ns - span.begin_ns;
+        }
+    }
+
+    // attribute FSM events since the last change of file to the current one
+    void charge(std::size_t fsm_events) {
+        if (!m_open.empty()) {
+            m_spans[m_open.back()].fsm_events += fsm_events - m_fsm_events;
+        }
+        m_fsm_events = fsm_events;
+    }
+
+    trace_log &              m_log;
+    std::vector<trace_span>  m_spans;
+    std::vector<std::size_t> m_open;          // indices of the spans on the include stack
+    std::int64_t             m_include_start;
+    std::size_t              m_fsm_events = 0;
+};
+
+#endif // TRACE_HPP